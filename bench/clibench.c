@@ -0,0 +1,361 @@
+/*
+ * clibench: end-to-end benchmarks of the opfs, newfs and modfs commands
+ * Copyright (c) 2015-2020 Takuo Watanabe
+ */
+
+/* usage: clibench [-b bindir] [-d workdir] [-n maxfiles] [-j json_file]
+ *                 [blocks...]
+ *     bindir : directory containing opfs, newfs and modfs (default: .)
+ *     workdir : directory for the image and data files (default: /tmp)
+ *     maxfiles : maximum # of files in a workload (default: 2000)
+ *     json_file : file to which the results are written in JSON
+ *     blocks : image sizes in blocks (default: 1000 10000 100000 1000000)
+ *
+ * For each image size, clibench makes a new image with newfs and runs the
+ * following workloads, each of which is a sequence of command invocations:
+ *     put : puts n files of 4 KiB into a directory
+ *     get : gets the n files
+ *     churn : renames half of the files and removes the other half
+ *     deep : makes a chain of nested directories (up to depth 100)
+ *     hugedir : puts n empty files into a single directory
+ *     modfs : reads the size of n inodes with modfs
+ * where n is 1/50 of the image size, between 10 and maxfiles.  For each
+ * workload, it reports the throughput, latency percentiles, peak RSS and
+ * page faults of the commands, and the growth: the ratio of the mean
+ * latency of the last tenth of the commands to that of the first tenth,
+ * which exposes operations whose cost grows with the file system.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "libfs.h"
+
+#define FILESIZE 4096
+#define MAXDEPTH 100
+
+static char *bindir = ".";
+static char *workdir = "/tmp";
+static uint maxfiles = 2000;
+
+static char img_file[BUFSIZE];
+static char data_file[BUFSIZE];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Running commands
+ */
+
+// measurements of a workload
+struct workload {
+    char *name;
+    uint n;             // # of commands run
+    uint nfail;         // # of commands that failed
+    double *lat;        // latency of each command (ns)
+    uint64 bytes;       // bytes transferred by put or get
+    long maxrss;        // peak RSS of the commands (KiB)
+    long minflt;        // minor page faults
+    long majflt;        // major page faults
+};
+
+// runs the command prog (in bindir) with args, reading stdin from in
+// (or /dev/null), and records its latency and resource usage in w
+static void run(struct workload *w, char *in, char *prog, ...) {
+    char path[BUFSIZE];
+    snprintf(path, sizeof(path), "%s/%s", bindir, prog);
+    char *argv[8];
+    int argc = 0;
+    argv[argc++] = path;
+    va_list args;
+    va_start(args, prog);
+    for (char *a; argc < 7 && (a = va_arg(args, char *)) != NULL; )
+        argv[argc++] = a;
+    va_end(args);
+    argv[argc] = NULL;
+
+    double t0 = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int ifd = open(in != NULL ? in : "/dev/null", O_RDONLY);
+        int ofd = open("/dev/null", O_WRONLY);
+        if (ifd < 0 || ofd < 0)
+            _exit(127);
+        dup2(ifd, 0);
+        dup2(ofd, 1);
+        dup2(ofd, 2);
+        execv(path, argv);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+    w->lat[w->n++] = now_ns() - t0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        w->nfail++;
+    if (ru.ru_maxrss > w->maxrss)
+        w->maxrss = ru.ru_maxrss;
+    w->minflt += ru.ru_minflt;
+    w->majflt += ru.ru_majflt;
+}
+
+/*
+ * Reporting
+ */
+
+static int dblcmp(const void *x, const void *y) {
+    double a = *(const double *)x, b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+// result of a workload
+struct result {
+    uint blocks;
+    char *name;
+    uint ops;
+    uint nfail;
+    double seconds;
+    double ops_per_sec;
+    double mb_per_sec;
+    double p50, p90, p99, max;  // ms
+    double growth;
+    long maxrss;
+    long minflt;
+    long majflt;
+};
+
+static struct result *results = NULL;
+static uint nresults = 0;
+
+static void summarize(uint blocks, struct workload *w) {
+    if (w->n == 0)
+        return;
+    double total = 0;
+    for (uint i = 0; i < w->n; i++)
+        total += w->lat[i];
+    // growth is taken before sorting
+    uint k = w->n / 10 > 0 ? w->n / 10 : 1;
+    double first = 0, last = 0;
+    for (uint i = 0; i < k; i++) {
+        first += w->lat[i];
+        last += w->lat[w->n - 1 - i];
+    }
+    qsort(w->lat, w->n, sizeof(double), dblcmp);
+
+    struct result r;
+    r.blocks = blocks;
+    r.name = w->name;
+    r.ops = w->n;
+    r.nfail = w->nfail;
+    r.seconds = total / 1e9;
+    r.ops_per_sec = w->n / r.seconds;
+    r.mb_per_sec = w->bytes / r.seconds / 1e6;
+    r.p50 = w->lat[w->n * 50 / 100] / 1e6;
+    r.p90 = w->lat[w->n * 90 / 100] / 1e6;
+    r.p99 = w->lat[w->n * 99 / 100] / 1e6;
+    r.max = w->lat[w->n - 1] / 1e6;
+    r.growth = last / first;
+    r.maxrss = w->maxrss;
+    r.minflt = w->minflt;
+    r.majflt = w->majflt;
+
+    results = realloc(results, (nresults + 1) * sizeof(struct result));
+    results[nresults++] = r;
+    printf("%8u %-8s %6u %5u %9.1f %7.2f %8.3f %8.3f %8.3f %8.3f %7.2f "
+           "%9ld %9ld %7ld\n",
+           r.blocks, r.name, r.ops, r.nfail, r.ops_per_sec, r.mb_per_sec,
+           r.p50, r.p90, r.p99, r.max, r.growth,
+           r.maxrss, r.minflt, r.majflt);
+    fflush(stdout);
+}
+
+static int write_json(char *file) {
+    FILE *fp = fopen(file, "w");
+    if (fp == NULL) {
+        perror(file);
+        return -1;
+    }
+    fprintf(fp, "{\n  \"timestamp\": %ld,\n  \"results\": [", (long)time(NULL));
+    for (uint i = 0; i < nresults; i++) {
+        struct result *r = &results[i];
+        fprintf(fp, "%s\n    {\"blocks\": %u, \"workload\": \"%s\", "
+                "\"ops\": %u, \"failures\": %u, \"seconds\": %.6f, "
+                "\"ops_per_sec\": %.3f, \"mb_per_sec\": %.3f, "
+                "\"p50_ms\": %.6f, \"p90_ms\": %.6f, \"p99_ms\": %.6f, "
+                "\"max_ms\": %.6f, \"growth\": %.4f, \"maxrss_kb\": %ld, "
+                "\"minflt\": %ld, \"majflt\": %ld}",
+                i == 0 ? "" : ",", r->blocks, r->name, r->ops, r->nfail,
+                r->seconds, r->ops_per_sec, r->mb_per_sec, r->p50, r->p90,
+                r->p99, r->max, r->growth, r->maxrss, r->minflt, r->majflt);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Workloads
+ */
+
+static void bench_size(uint blocks) {
+    uint n = blocks / 50;
+    n = n < 10 ? 10 : n > maxfiles ? maxfiles : n;
+    uint ninodes = 3 * n + 100;
+    char size_s[16], ninodes_s[16], name[64], name2[64];
+    snprintf(size_s, sizeof(size_s), "%u", blocks);
+    snprintf(ninodes_s, sizeof(ninodes_s), "%u", ninodes);
+
+    struct workload w;
+    double *lat = malloc(maxfiles * sizeof(double));
+#define BEGIN(s) w = (struct workload){ s, 0, 0, lat, 0, 0, 0, 0 }
+#define END() summarize(blocks, &w)
+
+    BEGIN("newfs");
+    run(&w, NULL, "newfs", img_file, size_s, ninodes_s, "30", NULL);
+    END();
+
+    double setup_lat[2];
+    struct workload setup = { "setup", 0, 0, setup_lat, 0, 0, 0, 0 };
+    run(&setup, NULL, "opfs", img_file, "mkdir", "/p", NULL);
+    run(&setup, NULL, "opfs", img_file, "mkdir", "/h", NULL);
+
+    BEGIN("put");
+    for (uint i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/p/f%u", i);
+        run(&w, data_file, "opfs", img_file, "put", name, NULL);
+        w.bytes += FILESIZE;
+    }
+    END();
+
+    BEGIN("get");
+    for (uint i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/p/f%u", i);
+        run(&w, NULL, "opfs", img_file, "get", name, NULL);
+        w.bytes += FILESIZE;
+    }
+    END();
+
+    BEGIN("modfs");
+    for (uint i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%u", i + 1);
+        run(&w, NULL, "modfs", img_file, "inode.size", name, NULL);
+    }
+    END();
+
+    BEGIN("churn");
+    for (uint i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/p/f%u", i);
+        snprintf(name2, sizeof(name2), "/p/g%u", i);
+        if (i % 2 == 0)
+            run(&w, NULL, "opfs", img_file, "mv", name, name2, NULL);
+        else
+            run(&w, NULL, "opfs", img_file, "rm", name, NULL);
+    }
+    END();
+
+    BEGIN("deep");
+    char path[3 * MAXDEPTH + 8] = "";
+    for (uint i = 0; i < n && i < MAXDEPTH; i++) {
+        strcat(path, "/d");
+        run(&w, NULL, "opfs", img_file, "mkdir", path, NULL);
+    }
+    END();
+
+    BEGIN("hugedir");
+    for (uint i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/h/f%u", i);
+        run(&w, NULL, "opfs", img_file, "put", name, NULL);
+    }
+    END();
+
+#undef BEGIN
+#undef END
+    free(lat);
+    unlink(img_file);
+}
+
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    char *json_file = NULL;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc)
+            break;
+        if (strcmp(argv[i], "-b") == 0)
+            bindir = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0)
+            workdir = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0)
+            maxfiles = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0)
+            json_file = argv[++i];
+        else
+            break;
+    }
+    if ((i < argc && argv[i][0] == '-') || maxfiles < 10) {
+        error("usage: %s [-b bindir] [-d workdir] [-n maxfiles] "
+              "[-j json_file] [blocks...]\n", progname);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(img_file, sizeof(img_file), "%s/clibench-%d.img",
+             workdir, (int)getpid());
+    snprintf(data_file, sizeof(data_file), "%s/clibench-%d.dat",
+             workdir, (int)getpid());
+    FILE *fp = fopen(data_file, "w");
+    if (fp == NULL) {
+        perror(data_file);
+        return EXIT_FAILURE;
+    }
+    for (uint k = 0; k < FILESIZE; k++)
+        fputc('a' + k % 26, fp);
+    fclose(fp);
+
+    printf("%8s %-8s %6s %5s %9s %7s %8s %8s %8s %8s %7s %9s %9s %7s\n",
+           "blocks", "workload", "ops", "fail", "ops/s", "MB/s",
+           "p50_ms", "p90_ms", "p99_ms", "max_ms", "growth",
+           "maxrss_kb", "minflt", "majflt");
+    if (i == argc) {
+        static const uint sizes[] = { 1000, 10000, 100000, 1000000 };
+        for (uint k = 0; k < ALEN(sizes); k++)
+            bench_size(sizes[k]);
+    }
+    for (; i < argc; i++)
+        bench_size(strtoul(argv[i], NULL, 10));
+    unlink(data_file);
+
+    if (json_file != NULL && write_json(json_file) < 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/* For Emacs
+ * Local Variables: ***
+ * c-file-style: "gnu" ***
+ * c-basic-offset: 4 ***
+ * End: ***
+ */
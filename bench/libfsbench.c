@@ -0,0 +1,457 @@
+/*
+ * libfsbench: microbenchmarks of the libfs operations
+ * Copyright (c) 2015-2020 Takuo Watanabe
+ */
+
+/* usage: libfsbench [-r reps] [-s scale] [filter]
+ *     reps : # of samples taken for each benchmark (default: 10)
+ *     scale : multiplier of the # of operations per sample (default: 1)
+ *     filter : runs only the benchmarks whose names contain filter
+ *
+ * Each benchmark runs on a synthetic image built in memory.  The results
+ * are printed as CSV lines, one per benchmark and parameter, with the mean,
+ * standard deviation, minimum and maximum of the time per operation over
+ * the samples, followed by the fragmentation of the image for the
+ * benchmarks of block allocation (empty for the others).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+
+#include "libfs.h"
+
+static uint reps = 10;
+static uint scale = 1;
+static char *filter = NULL;
+
+/*
+ * Timing and statistics
+ */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// samples of the time per operation (ns)
+struct samples {
+    uint n;
+    double v[1000];
+};
+
+// fragmentation of an image: mean # of runs of contiguous blocks per file
+// and # of runs of free blocks
+struct frag {
+    double runs;
+    uint free_runs;
+};
+
+static void report_frag(char *name, char *param, uint ops, struct samples *s,
+                        const struct frag *f) {
+    double sum = 0, min = s->v[0], max = s->v[0];
+    for (uint i = 0; i < s->n; i++) {
+        sum += s->v[i];
+        min = s->v[i] < min ? s->v[i] : min;
+        max = s->v[i] > max ? s->v[i] : max;
+    }
+    double mean = sum / s->n, var = 0;
+    for (uint i = 0; i < s->n; i++)
+        var += (s->v[i] - mean) * (s->v[i] - mean);
+    var = s->n > 1 ? var / (s->n - 1) : 0;
+    printf("%s,%s,%u,%u,%.1f,%.1f,%.1f,%.1f,", name, param, ops, s->n,
+           mean, sqrt(var), min, max);
+    if (f != NULL)
+        printf("%.2f,%u\n", f->runs, f->free_runs);
+    else
+        printf(",\n");
+    fflush(stdout);
+}
+
+static void report(char *name, char *param, uint ops, struct samples *s) {
+    report_frag(name, param, ops, s, NULL);
+}
+
+static bool selected(char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+// deterministic pseudo random numbers (xorshift32)
+static uint rnd_state = 2463534242U;
+
+static uint rnd(void) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/*
+ * Synthetic images
+ */
+
+static struct img img_buf;
+
+// makes an empty file system in memory
+static img_t mkimg(uint size, uint ninodes, uint features) {
+    static uchar *base = NULL;
+    free(base);
+    size_t nbytes = (size_t)size * BSIZE;
+    if ((base = calloc(1, nbytes)) == NULL) {
+        error("cannot allocate %zu bytes\n", nbytes);
+        exit(EXIT_FAILURE);
+    }
+    img_t img = &img_buf;
+    if (initimg(img, &fsformats[0], base, nbytes, BSIZE, features) < 0 ||
+        mkfs(img, size, ninodes, 30) < 0) {
+        error("cannot make a file system\n");
+        exit(EXIT_FAILURE);
+    }
+    root_inode = iget(img, root_inode_number);
+    rnd_state = 2463534242U;
+    return img;
+}
+
+// makes a directory dp with n empty files named f0, f1, ...
+static inode_t mkfiles(img_t img, char *dir, uint n) {
+    inode_t dp = icreat(img, root_inode, dir, T_DIR, NULL);
+    char name[DIRSIZ + 1];
+    for (uint i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "f%u", i);
+        icreat(img, dp, name, T_FILE, NULL);
+    }
+    return dp;
+}
+
+/*
+ * Benchmarks
+ */
+
+// balloc followed by bfree of the same blocks
+static void bench_balloc(void) {
+    const uint nops = 2000 * scale;
+    img_t img = mkimg(nops + 1000, 200, 0);
+    uint *bs = malloc(nops * sizeof(uint));
+    struct samples sa = { 0 }, sf = { 0 };
+    for (uint r = 0; r < reps; r++) {
+        double t0 = now_ns();
+        for (uint i = 0; i < nops; i++)
+            bs[i] = balloc(img);
+        double t1 = now_ns();
+        for (uint i = 0; i < nops; i++)
+            bfree(img, bs[i]);
+        double t2 = now_ns();
+        sa.v[sa.n++] = (t1 - t0) / nops;
+        sf.v[sf.n++] = (t2 - t1) / nops;
+    }
+    report("balloc", "-", nops, &sa);
+    report("bfree", "-", nops, &sf);
+    free(bs);
+}
+
+// ialloc of all the inodes of an image
+static void bench_ialloc(void) {
+    const uint nops = 2000 * scale;
+    img_t img = mkimg(2000, nops + 2, 0);  // inode 0 and the root
+    uint *is = malloc(nops * sizeof(uint));
+    struct samples s = { 0 };
+    for (uint r = 0; r < reps; r++) {
+        double t0 = now_ns();
+        for (uint i = 0; i < nops; i++)
+            is[i] = geti(img, ialloc(img, T_FILE));
+        double t1 = now_ns();
+        for (uint i = 0; i < nops; i++)
+            ifree(img, is[i]);
+        s.v[s.n++] = (t1 - t0) / nops;
+    }
+    report("ialloc", "-", nops, &s);
+    free(is);
+}
+
+// dlookup of random names in directories of various sizes
+static void bench_dlookup(char *name, uint features) {
+    static const uint sizes[] = { 16, 256, 4096 };
+    for (uint k = 0; k < ALEN(sizes); k++) {
+        uint n = sizes[k];
+        const uint nops = (n >= 4096 ? 2000 : 20000) * scale;
+        img_t img = mkimg(2000, n + 10, features);
+        inode_t dp = mkfiles(img, "d", n);
+        char fname[DIRSIZ + 1];
+        struct samples s = { 0 };
+        for (uint r = 0; r < reps; r++) {
+            double t = 0;
+            for (uint i = 0; i < nops; i++) {
+                snprintf(fname, sizeof(fname), "f%u", rnd() % n);
+                double t0 = now_ns();
+                if (dlookup(img, dp, fname, NULL) == NULL)
+                    error("dlookup: %s: not found\n", fname);
+                t += now_ns() - t0;
+            }
+            s.v[s.n++] = t / nops;
+        }
+        char param[32];
+        snprintf(param, sizeof(param), "entries=%u", n);
+        report(name, param, nops, &s);
+    }
+}
+
+// ilookup of a file at various depths
+static void bench_ilookup(void) {
+    static const uint depths[] = { 1, 4, 16 };
+    for (uint k = 0; k < ALEN(depths); k++) {
+        uint depth = depths[k];
+        const uint nops = 20000 * scale;
+        img_t img = mkimg(2000, 200, 0);
+        char path[BUFSIZE] = "";
+        for (uint i = 1; i < depth; i++) {
+            strcat(path, "/d");
+            icreat(img, root_inode, path, T_DIR, NULL);
+        }
+        strcat(path, "/f");
+        icreat(img, root_inode, path, T_FILE, NULL);
+        struct samples s = { 0 };
+        for (uint r = 0; r < reps; r++) {
+            double t0 = now_ns();
+            for (uint i = 0; i < nops; i++)
+                ilookup(img, root_inode, path);
+            s.v[s.n++] = (now_ns() - t0) / nops;
+        }
+        char param[32];
+        snprintf(param, sizeof(param), "depth=%u", depth);
+        report("ilookup", param, nops, &s);
+    }
+}
+
+// iread and iwrite of various sizes at aligned and unaligned offsets
+static void bench_iread_iwrite(void) {
+    static const uint sizes[] = { 64, 1024, 16384, 131072 };
+    const uint fsize = 262144;
+    img_t img = mkimg(2000, 200, 0);
+    inode_t ip = icreat(img, root_inode, "f", T_FILE, NULL);
+    uchar *buf = calloc(1, fsize);
+    iwrite(img, ip, buf, fsize, 0);
+    for (uint k = 0; k < ALEN(sizes); k++) {
+        for (uint unaligned = 0; unaligned <= 1; unaligned++) {
+            uint n = sizes[k];
+            const uint nops = (n >= 16384 ? 500 : 5000) * scale;
+            uint nslots = (fsize - n) / BSIZE;
+            struct samples sr = { 0 }, sw = { 0 };
+            for (uint r = 0; r < reps; r++) {
+                double tr = 0, tw = 0;
+                for (uint i = 0; i < nops; i++) {
+                    uint off = (rnd() % nslots) * BSIZE + unaligned * 7;
+                    double t0 = now_ns();
+                    iread(img, ip, buf, n, off);
+                    double t1 = now_ns();
+                    iwrite(img, ip, buf, n, off);
+                    tw += now_ns() - t1;
+                    tr += t1 - t0;
+                }
+                sr.v[sr.n++] = tr / nops;
+                sw.v[sw.n++] = tw / nops;
+            }
+            char param[32];
+            snprintf(param, sizeof(param), "size=%u/%s",
+                     n, unaligned ? "unaligned" : "aligned");
+            report("iread", param, nops, &sr);
+            report("iwrite", param, nops, &sw);
+        }
+    }
+    free(buf);
+}
+
+// itruncate of files of various sizes to zero
+static void bench_itruncate(void) {
+    static const uint sizes[] = { 1024, 16384, 262144 };
+    img_t img = mkimg(2000, 200, 0);
+    inode_t ip = icreat(img, root_inode, "f", T_FILE, NULL);
+    uchar *buf = calloc(1, 262144);
+    for (uint k = 0; k < ALEN(sizes); k++) {
+        uint n = sizes[k];
+        const uint nops = 200 * scale;
+        struct samples s = { 0 };
+        for (uint r = 0; r < reps; r++) {
+            double t = 0;
+            for (uint i = 0; i < nops; i++) {
+                iwrite(img, ip, buf, n, 0);
+                double t0 = now_ns();
+                itruncate(img, ip, 0);
+                t += now_ns() - t0;
+            }
+            s.v[s.n++] = t / nops;
+        }
+        char param[32];
+        snprintf(param, sizeof(param), "size=%u", n);
+        report("itruncate", param, nops, &s);
+    }
+    free(buf);
+}
+
+// writes the files idx[0..n) in directory dp of 1 to 32 blocks, creating
+// them, m at a time appending a block to each in turn; returns the # of
+// blocks written
+static uint write_files(img_t img, inode_t dp, inode_t *files, uint *idx,
+                        uint n, uint m, uchar *buf) {
+    uint nblocks = 0;
+    uint *size = malloc(m * sizeof(uint));
+    for (uint i = 0; i < n; i += m) {
+        uint nw = n - i < m ? n - i : m, maxsize = 0;
+        for (uint j = 0; j < nw; j++) {
+            char name[DIRSIZ + 1];
+            snprintf(name, sizeof(name), "f%u", idx[i + j]);
+            files[idx[i + j]] = icreat(img, dp, name, T_FILE, NULL);
+            size[j] = rnd() % 32 + 1;
+            maxsize = size[j] > maxsize ? size[j] : maxsize;
+            nblocks += size[j];
+        }
+        for (uint k = 0; k < maxsize; k++)
+            for (uint j = 0; j < nw; j++)
+                if (k < size[j])
+                    iwrite(img, files[idx[i + j]], buf, BSIZE, k * BSIZE);
+    }
+    free(size);
+    return nblocks;
+}
+
+// measures the fragmentation of an image with the files files[0..nfiles)
+static struct frag fragmentation(img_t img, inode_t *files, uint nfiles) {
+    uint64 runs = 0;
+    for (uint i = 0; i < nfiles; i++) {
+        uint n = (files[i]->size + BSIZE - 1) / BSIZE;
+        uint iaddr = files[i]->addrs[img->ndirect], prev = 0;
+        for (uint k = 0; k < n; k++) {
+            // an indirect block between two data blocks is not a break
+            uint b = bmap(img, files[i], k);
+            runs += k == 0 || (b != prev + 1 && !(b == prev + 2 &&
+                                                  prev + 1 == iaddr));
+            prev = b;
+        }
+    }
+    uint free_runs = 0;
+    bool in_run = false;
+    for (uint b = 0; b < SBLK(img)->size; b++) {
+        uchar *bp = BLK(img, BBLK(img, b));
+        uint bi = b % img->bpb;
+        bool isfree = valid_data_block(img, b) &&
+            (bp[bi / 8] & (1 << (bi % 8))) == 0;
+        free_runs += isfree && !in_run;
+        in_run = isfree;
+    }
+    return (struct frag){ (double)runs / nfiles, free_runs };
+}
+
+// writes files under each block allocation policy by one and by several
+// writers: a bulk build of an empty image, then churn (files replaced at
+// random) of the full image; the time is per block written and the
+// fragmentation is that of the last sample
+static void bench_balloc_policy(void) {
+    static const uint writers[] = { 1, 4 };
+    const uint nfiles = 500 * scale, nops = 200 * scale;
+    inode_t *files = malloc(nfiles * sizeof(inode_t));
+    uint *idx = malloc(nfiles * sizeof(uint));
+    uchar *buf = calloc(1, BSIZE);
+    for (uint p = 0; p < NBPOLICIES; p++)
+        for (uint w = 0; w < ALEN(writers); w++) {
+            uint m = writers[w];
+            struct samples sb = { 0 }, sc = { 0 };
+            uint nbulk = 0, nchurn = 0;
+            struct frag fb = { 0, 0 }, fc = { 0, 0 };
+            char pbulk[48], pchurn[48];
+            snprintf(pbulk, sizeof(pbulk), "%s/bulk/writers=%u",
+                     balloc_policy_names[p], m);
+            snprintf(pchurn, sizeof(pchurn), "%s/churn/writers=%u",
+                     balloc_policy_names[p], m);
+            for (uint r = 0; r < reps; r++) {
+                img_t img = mkimg(nfiles * 21 + 200, nfiles + 20, 0);
+                img->bpolicy = p;
+                inode_t dp = icreat(img, root_inode, "d", T_DIR, NULL);
+                for (uint i = 0; i < nfiles; i++)
+                    idx[i] = i;
+                double t0 = now_ns();
+                nbulk = write_files(img, dp, files, idx, nfiles, m, buf);
+                sb.v[sb.n++] = (now_ns() - t0) / nbulk;
+                if (r == reps - 1)
+                    fb = fragmentation(img, files, nfiles);
+
+                double t = 0;
+                nchurn = 0;
+                for (uint i = 0; i < nops; i += m) {
+                    char name[DIRSIZ + 1];
+                    for (uint j = 0; j < m; j++) {
+                        // distinct files, so that each is removed once
+                        idx[j] = (rnd() % (nfiles / m)) * m + j;
+                        snprintf(name, sizeof(name), "f%u", idx[j]);
+                        iunlink(img, dp, name);
+                    }
+                    t0 = now_ns();
+                    nchurn += write_files(img, dp, files, idx, m, m, buf);
+                    t += now_ns() - t0;
+                }
+                sc.v[sc.n++] = t / nchurn;
+                if (r == reps - 1)
+                    fc = fragmentation(img, files, nfiles);
+            }
+            report_frag("balloc-policy", pbulk, nbulk, &sb, &fb);
+            report_frag("balloc-policy", pchurn, nchurn, &sc, &fc);
+        }
+    free(files);
+    free(idx);
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else
+            break;
+    }
+    if (argc - i > 1 || reps < 1 || reps > 1000 || scale < 1) {
+        error("usage: %s [-r reps] [-s scale] [filter]\n", progname);
+        return EXIT_FAILURE;
+    }
+    if (i < argc)
+        filter = argv[i];
+
+    if (setjmp(fatal_exception_buf) != 0)
+        return EXIT_FAILURE;
+
+    printf("benchmark,param,ops,samples,mean_ns,stddev_ns,min_ns,max_ns,"
+           "runs_per_file,free_runs\n");
+    if (selected("balloc") || selected("bfree"))
+        bench_balloc();
+    if (selected("ialloc"))
+        bench_ialloc();
+    if (selected("dlookup"))
+        bench_dlookup("dlookup", 0);
+    if (selected("dlookup-indexed"))
+        bench_dlookup("dlookup-indexed", FS_DIRINDEX);
+    if (selected("ilookup"))
+        bench_ilookup();
+    if (selected("iread") || selected("iwrite"))
+        bench_iread_iwrite();
+    if (selected("itruncate"))
+        bench_itruncate();
+    if (selected("balloc-policy"))
+        bench_balloc_policy();
+    return EXIT_SUCCESS;
+}
+
+/* For Emacs
+ * Local Variables: ***
+ * c-file-style: "gnu" ***
+ * c-basic-offset: 4 ***
+ * End: ***
+ */
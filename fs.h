@@ -3,7 +3,7 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#define BSIZE 1024  // default block size
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -20,10 +20,20 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (opfs extension; 0 means the default)
+  uint features;     // Format feature flags (opfs extension)
 };
 
 #define FSMAGIC 0x10203040
 
+// Format feature flags
+#define FS_DINDIRECT 0x1  // addrs[NDIRECT-1] is singly indirect and
+                          // addrs[NDIRECT] is doubly indirect
+#define FS_EXTENTS   0x2  // addrs[] holds extents instead of block numbers
+#define FS_INLINE    0x4  // small files are stored in addrs[]
+#define FS_DIRINDEX  0x8  // directories growing beyond a block are indexed
+#define FS_WIDEINUM  0x10 // directory entries have 32-bit inode numbers
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
@@ -38,6 +48,21 @@ struct dinode {
   uint addrs[NDIRECT+1];   // Data block addresses
 };
 
+// With FS_EXTENTS, addrs[0..NDIRECT-1] holds the first NEXTENT extents
+// of the file in file order and addrs[NDIRECT] is the block number of an
+// overflow block holding further extents; a zero length ends the list.
+struct extent {
+  uint start;           // First block
+  uint len;             // Number of blocks
+};
+
+#define NEXTENT (NDIRECT * sizeof(uint) / sizeof(struct extent))
+
+// With FS_INLINE, a file (T_FILE) whose major field has I_INLINE set keeps
+// its data, at most INLINESIZE bytes, in addrs[] instead of data blocks.
+#define I_INLINE 0x1
+#define INLINESIZE (sizeof(uint) * (NDIRECT + 1))
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -58,3 +83,39 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// With FS_WIDEINUM, directory entries have 32-bit inode numbers in place
+// of the first two bytes of the name, so that they have the same size.
+#define WDIRSIZ 12
+
+struct wdirent {
+  uint inum;
+  char name[WDIRSIZ];
+};
+
+// A directory whose major field has I_INDEX set is a hash tree.  Block 0
+// holds ".", "..", a struct dxhead and the root index entries; the other
+// blocks are either index nodes (a struct dxhead followed by index
+// entries) or leaves of ordinary dirents.  Every index record starts with
+// a zero word, so that readers unaware of the index see unused dirents.
+#define I_INDEX 0x2
+// A directory whose major field has I_NOINDEX set lost its index because
+// the index could not take more entries; it is not indexed again when it
+// grows, only when it is compacted or indexed explicitly.
+#define I_NOINDEX 0x4
+#define DXMAGIC 0x78647864
+
+struct dxhead {
+  uint zero;            // Always 0
+  uint magic;           // Must be DXMAGIC
+  ushort levels;        // Levels of index nodes below the root (0 or 1)
+  ushort count;         // Number of index entries following the header
+  uint unused;
+};
+
+struct dxentry {
+  uint zero;            // Always 0
+  uint hash;            // Lowest name hash in the child block
+  uint block;           // Child block (block number within the directory)
+  uint unused;
+};
+
@@ -0,0 +1,412 @@
+/*
+ * opfs: a simple utility for generating synthetic xv6 file system images
+ * Copyright (c) 2015-2020 Takuo Watanabe
+ */
+
+/* usage: genfs [newfs options] [--seed seed] [--balloc policy]
+ *              [--profile profile]
+ *              [--size-median bytes] [--size-sigma sigma]
+ *              [--fanout n] [--depth n] [--hardlinks ratio]
+ *              [--frag ratio] [--fill percent]
+ *              img_file size ninodes nlog
+ *     newfs options : --format, --bsize, --dindirect, --extents, --inline,
+ *                     --dir-index and --wide-inum (see newfs)
+ *     seed : seed of the pseudo random numbers (default: 1)
+ *     policy : block allocation policy (default: first-fit, regardless of
+ *              OPFS_BALLOC)
+ *     profile : default, small, source, media or aged
+ *     size-median, size-sigma : file sizes follow the log-normal
+ *                               distribution with this median and sigma
+ *     fanout, depth : shape of the directory tree
+ *     hardlinks : ratio of hard links to new files
+ *     frag : ratio of deletions to creations, which fragments free space
+ *     fill : percentage of the data blocks to be used
+ *     size : total # of blocks
+ *     ninodes : # of inodes
+ *     nlog : # of log blocks
+ *
+ * The same arguments always generate the same image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include "libfs.h"
+
+// parameters of generated file systems
+struct profile {
+    char *name;
+    double size_median;     // median file size (bytes)
+    double size_sigma;      // sigma of log(file size)
+    uint fanout;            // # of subdirectories of a directory
+    uint depth;             // depth of the directory tree
+    double hardlinks;       // ratio of hard links to new files
+    double frag;            // ratio of deletions to creations
+    double fill;            // percentage of the data blocks to be used
+};
+
+static const struct profile profiles[] = {
+    { "default", 4096, 1.5, 8, 3, 0.02, 0.1, 50 },
+    { "small", 512, 1.0, 16, 2, 0.0, 0.0, 30 },
+    { "source", 8192, 1.2, 6, 5, 0.01, 0.05, 50 },
+    { "media", 1 << 20, 1.0, 4, 2, 0.0, 0.0, 80 },
+    { "aged", 4096, 2.0, 8, 4, 0.05, 0.5, 85 },
+};
+
+/*
+ * Pseudo random numbers (xorshift64*)
+ */
+
+static uint64 rnd_state;
+
+static void rnd_seed(uint64 seed) {
+    // splitmix64 so that small seeds give unrelated sequences
+    uint64 z = seed + 0x9e3779b97f4a7c15UL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    rnd_state = (z ^ (z >> 31)) | 1;
+}
+
+static uint64 rnd(void) {
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return rnd_state * 0x2545f4914f6cdd1dUL;
+}
+
+// uniform in [0, 1)
+static double rnd_unit(void) {
+    return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// log-normal with median m and sigma s
+static double rnd_lognormal(double m, double s) {
+    double u = rnd_unit(), v = rnd_unit();
+    double z = sqrt(-2 * log(1 - u)) * cos(2 * 3.14159265358979323846 * v);
+    return m * exp(s * z);
+}
+
+/*
+ * Generation
+ */
+
+// a directory entry made by genfs
+struct entry {
+    uint dir;               // inode number of the directory
+    char name[DIRSIZ + 1];
+};
+
+struct gen {
+    img_t img;
+    const struct profile *prof;
+    uint *dirs;             // inode numbers of the directories
+    uint ndirs;
+    struct entry *ents;     // live entries of files
+    uint nents;
+    uint inodes;            // # of inodes in use
+    uint64 nfree;           // lower bound of the # of free blocks
+    uint nbytes_max;        // maximum file size
+    uchar *data;            // source of file contents
+    uint serial;            // serial number for file names
+    uint nfiles, nlinks, ndeleted;
+};
+
+// counts the free blocks in the bitmap
+static uint64 count_free(img_t img) {
+    struct superblock *sb = SBLK(img);
+    uint64 used = 0;
+    for (uint b = 0; b < sb->size; b += img->bpb) {
+        uchar *bp = BLK(img, BBLK(img, b));
+        uint n = sb->size - b < img->bpb ? sb->size - b : img->bpb;
+        for (uint i = 0; i < n / 8; i++)
+            used += bitcount(bp[i]);
+        for (uint i = n / 8 * 8; i < n; i++)
+            used += (bp[i / 8] >> (i % 8)) & 1;
+    }
+    return sb->size - used;
+}
+
+// upper bound of the # of blocks used by a file of n bytes
+static uint64 blocks_needed(img_t img, uint n) {
+    uint64 nb = (n + img->bsize - 1) / img->bsize;
+    return nb + 2 + nb / img->nindirect;
+}
+
+// makes the directory tree breadth first
+static void make_dirs(struct gen *g, uint maxdirs) {
+    g->dirs[g->ndirs++] = root_inode_number;
+    uint level_start = 0, level_end = 1;
+    for (uint d = 0; d < g->prof->depth; d++) {
+        for (uint i = level_start; i < level_end; i++) {
+            for (uint k = 0; k < g->prof->fanout; k++) {
+                if (g->ndirs >= maxdirs)
+                    return;
+                char name[DIRSIZ + 1];
+                snprintf(name, sizeof(name), "d%u", k);
+                inode_t ip = icreat(g->img, iget(g->img, g->dirs[i]), name,
+                                    T_DIR, NULL);
+                if (ip == NULL)
+                    return;
+                g->dirs[g->ndirs++] = geti(g->img, ip);
+                g->inodes++;
+            }
+        }
+        level_start = level_end;
+        level_end = g->ndirs;
+    }
+}
+
+// picks a directory that can have one more entry
+static inode_t pick_dir(struct gen *g) {
+    for (int tries = 0; tries < 8; tries++) {
+        inode_t dp = iget(g->img, g->dirs[rnd() % g->ndirs]);
+        if (dp->size + sizeof(struct dirent) <= g->img->maxfilesize)
+            return dp;
+    }
+    return NULL;
+}
+
+// creates a file; returns false if the file system is full
+static bool create_file(struct gen *g) {
+    img_t img = g->img;
+    double sz = rnd_lognormal(g->prof->size_median, g->prof->size_sigma);
+    uint n = sz < g->nbytes_max ? (uint)sz : g->nbytes_max;
+    uint64 need = blocks_needed(img, n);
+    if (need > g->nfree) {
+        g->nfree = count_free(img);
+        if (need > g->nfree)
+            return false;
+    }
+    inode_t dp = pick_dir(g);
+    if (dp == NULL)
+        return false;
+    struct entry e;
+    e.dir = geti(img, dp);
+    snprintf(e.name, sizeof(e.name), "f%u", g->serial++);
+    inode_t ip = icreat(img, dp, e.name, T_FILE, NULL);
+    if (ip == NULL)
+        return false;
+    uint off = n > 0 ? rnd() % (g->nbytes_max - n + 1) : 0;
+    if (iwrite(img, ip, g->data + off, n, 0) != (int)n) {
+        error("genfs: %s: write error\n", e.name);
+        return false;
+    }
+    g->nfree -= need;
+    g->inodes++;
+    g->nfiles++;
+    g->ents[g->nents++] = e;
+    return true;
+}
+
+// adds a hard link to a random file
+static void link_file(struct gen *g) {
+    struct entry *t = &g->ents[rnd() % g->nents];
+    inode_t ip = dlookup(g->img, iget(g->img, t->dir), t->name, NULL);
+    inode_t dp = pick_dir(g);
+    if (ip == NULL || dp == NULL)
+        return;
+    struct entry e;
+    e.dir = geti(g->img, dp);
+    snprintf(e.name, sizeof(e.name), "l%u", g->serial++);
+    if (daddent(g->img, dp, e.name, ip) < 0)
+        return;
+    g->nlinks++;
+    g->ents[g->nents++] = e;
+}
+
+// removes a random entry
+static void delete_file(struct gen *g) {
+    uint k = rnd() % g->nents;
+    struct entry *e = &g->ents[k];
+    inode_t ip = dlookup(g->img, iget(g->img, e->dir), e->name, NULL);
+    bool last = ip != NULL && ip->nlink == 1;
+    if (iunlink(g->img, iget(g->img, e->dir), e->name) == 0 && last)
+        g->inodes--;
+    g->ndeleted++;
+    g->ents[k] = g->ents[--g->nents];
+}
+
+static int generate(img_t img, const struct profile *prof) {
+    struct superblock *sb = SBLK(img);
+    struct gen g = { 0 };
+    g.img = img;
+    g.prof = prof;
+    g.inodes = 1;
+    uint maxdirs = sb->ninodes / 8 + 1;
+    g.dirs = malloc(maxdirs * sizeof(uint));
+    g.ents = malloc(sb->ninodes * 2 * sizeof(struct entry));
+    g.nbytes_max = img->maxfilesize < (64U << 20) ?
+        img->maxfilesize : (64U << 20);
+    g.data = malloc(g.nbytes_max);
+    if (g.dirs == NULL || g.ents == NULL || g.data == NULL) {
+        error("genfs: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (uint i = 0; i < g.nbytes_max; i++)
+        g.data[i] = "abcdefghijklmnopqrstuvwxyz\n"[rnd() % 27];
+
+    make_dirs(&g, maxdirs);
+
+    // files are created until the target fill level is reached
+    g.nfree = count_free(img);
+    uint64 target = (uint64)(sb->nblocks * (100 - prof->fill) / 100);
+    while (g.inodes + 1 < sb->ninodes && g.nents + 1 < sb->ninodes * 2) {
+        if (g.nents > 0 && rnd_unit() < prof->hardlinks) {
+            link_file(&g);
+            continue;
+        }
+        if (!create_file(&g))
+            break;
+        if (g.nents > 0 && rnd_unit() < prof->frag)
+            delete_file(&g);
+        if (g.nfree <= target && (g.nfree = count_free(img)) <= target)
+            break;
+    }
+
+    uint64 nfree = count_free(img);
+    printf("profile: %s\n", prof->name);
+    printf("# of directories: %u\n", g.ndirs);
+    printf("# of files: %u (%u deleted)\n", g.nfiles - g.ndeleted, g.ndeleted);
+    printf("# of hard links: %u\n", g.nlinks);
+    printf("# of used data blocks: %lu (%.1f%%)\n",
+           sb->nblocks - nfree, 100.0 * (sb->nblocks - nfree) / sb->nblocks);
+    free(g.dirs);
+    free(g.ents);
+    free(g.data);
+    return EXIT_SUCCESS;
+}
+
+int setupfs(img_t img, uint size, uint ninodes, uint nlog,
+            const struct profile *prof) {
+    if (mkfs(img, size, ninodes, nlog) < 0)
+        return EXIT_FAILURE;
+    root_inode = iget(img, root_inode_number);
+    return generate(img, prof);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: %s [newfs options] [--seed seed] "
+            "[--balloc policy] [--profile profile]\n"
+            "       [--size-median bytes] [--size-sigma sigma] "
+            "[--fanout n] [--depth n]\n"
+            "       [--hardlinks ratio] [--frag ratio] [--fill percent]\n"
+            "       file size ninodes nlog\n", progname);
+}
+
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    struct fsopts o;
+    fsopts_init(&o);
+    uint64 seed = 1;
+    // the image must not depend on OPFS_BALLOC
+    balloc_setpolicy("first-fit");
+    struct profile prof = profiles[0];
+    // options overriding the profile are applied after it is chosen
+    double over[7];
+    bool given[7] = { false };
+    int i;
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        int r = fsopts_parse(&o, argc, argv, &i);
+        if (r < 0)
+            return EXIT_FAILURE;
+        if (r > 0)
+            continue;
+        static char *params[] = {
+            "--size-median", "--size-sigma", "--fanout", "--depth",
+            "--hardlinks", "--frag", "--fill"
+        };
+        uint k;
+        for (k = 0; k < ALEN(params); k++)
+            if (strcmp(argv[i], params[k]) == 0)
+                break;
+        if (k < ALEN(params) && i + 1 < argc) {
+            over[k] = atof(argv[++i]);
+            given[k] = true;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--balloc") == 0 && i + 1 < argc) {
+            if (balloc_setpolicy(argv[i + 1]) < 0) {
+                fprintf(stderr, "%s: %s: unknown allocation policy\n",
+                        progname, argv[i + 1]);
+                return EXIT_FAILURE;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            for (k = 0; k < ALEN(profiles); k++)
+                if (strcmp(argv[i + 1], profiles[k].name) == 0)
+                    break;
+            if (k == ALEN(profiles)) {
+                fprintf(stderr, "%s: %s: unknown profile\n", progname,
+                        argv[i + 1]);
+                return EXIT_FAILURE;
+            }
+            prof = profiles[k];
+            i++;
+        }
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - i != 4) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (given[0]) prof.size_median = over[0];
+    if (given[1]) prof.size_sigma = over[1];
+    if (given[2]) prof.fanout = over[2];
+    if (given[3]) prof.depth = over[3];
+    if (given[4]) prof.hardlinks = over[4];
+    if (given[5]) prof.frag = over[5];
+    if (given[6]) prof.fill = over[6];
+    if (prof.fill < 0 || prof.fill > 100 || prof.frag < 0 ||
+        prof.frag >= 1 || prof.hardlinks < 0 || prof.hardlinks >= 1) {
+        fprintf(stderr, "%s: fill must be 0-100, and frag and hardlinks "
+                "0 or more and less than 1\n", progname);
+        return EXIT_FAILURE;
+    }
+    if (fsopts_check(&o) < 0)
+        return EXIT_FAILURE;
+    char *file = argv[i];
+    uint size = strtoul(argv[i + 1], NULL, 10);
+    uint ninodes = strtoul(argv[i + 2], NULL, 10);
+    uint nlog = strtoul(argv[i + 3], NULL, 10);
+    if (fsopts_check_inodes(&o, ninodes) < 0)
+        return EXIT_FAILURE;
+    uint64 img_size = (uint64)o.bsize * size;
+    int fd;
+    uchar *img_base = createimg(file, img_size, &fd);
+    if (img_base == NULL)
+        return EXIT_FAILURE;
+
+    struct img img_buf;
+    img_t img = &img_buf;
+    initimg(img, o.fmt, img_base, img_size, o.bsize, o.features);
+    rnd_seed(seed);
+
+    int status = EXIT_FAILURE;
+    if (setjmp(fatal_exception_buf) == 0)
+        status = setupfs(img, size, ninodes, nlog, &prof);
+
+    munmap(img_base, img_size);
+    close(fd);
+    return status;
+}
+
+/* For Emacs
+ * Local Variables: ***
+ * c-file-style: "gnu" ***
+ * c-basic-offset: 4 ***
+ * End: ***
+ */
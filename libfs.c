@@ -3,6 +3,8 @@
  * Copyright (c) 2015-2019 Takuo Watanabe
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -11,9 +13,13 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <time.h>
 
 #include "libfs.h"
 
@@ -40,7 +46,7 @@
  * Nm = N / (BSIZE * 8) + 1
  * Nd = sb.nblocks
  *
- * BSIZE = 1024
+ * BSIZE = sb.bsize (1024 if sb.bsize == 0)
  * IPB = BSIZE / sizeof(struct dinode) = 1024 / 64 = 16
  *
  * Example: fs.img (xv6-riscv)
@@ -75,7 +81,11 @@
  * +-----------------+  |
  * | addrs[NDIRECT-1]|  |
  * +-----------------+  /
- * 
+ * | addrs[NDIRECT]  |  indirect block address [uint]
+ * +-----------------+
+ *
+ * With FS_DINDIRECT, addrs[NDIRECT-1] is the indirect block address and
+ * addrs[NDIRECT] is the double-indirect block address.
  */
 
 
@@ -91,8 +101,13 @@ static inline int max(int x, int y) {
     return x > y ? x : y;
 }
 
-// ceiling(x / y) where x >=0, y > 0
-static inline int divceil(int x, int y) {
+// min for byte and block counts, which may not fit in an int
+static inline uint64 umin(uint64 x, uint64 y) {
+    return x < y ? x : y;
+}
+
+// ceiling(x / y) where y > 0
+static inline uint divceil(uint64 x, uint y) {
     return (x + y - 1) / y;
 }
 
@@ -115,17 +130,222 @@ uint bitcount(uint x) {
 char *progname;
 jmp_buf fatal_exception_buf;
 
-void debug_message(const char *tag, const char *fmt, ...) {
-#ifndef NDEBUG
+// nesting level of the traced operations (see below); only the outermost
+// operations (those called by the application) are recorded
+static uint trace_depth = 0;
+
+// i-node blocks modified by the current operation, which are recorded in
+// the block trace as written once when the outermost operation returns
+#define NIDIRTY 8
+static uint idirty_blocks[NIDIRTY];
+static uint nidirty = 0;
+
+/*
+ * Logging
+ *
+ * A message is recorded in a per-thread buffer as its format string and
+ * the raw values of its arguments (strings are copied), and is formatted
+ * only when the buffer is flushed: when it fills up, before error() and
+ * fatal() print anything, and at exit.  Messages above log_level are
+ * rejected by the macros in libfs.h before any call is made.
+ */
+
+int log_level = LOG_WARNING;
+static bool log_level_set = false;   // set explicitly (not by OPFS_LOG)
+
+static const char *log_names[] = {
+    [LOG_NONE] = "none",
+    [LOG_ERROR] = "ERROR",
+    [LOG_WARNING] = "WARNING",
+    [LOG_DEBUG] = "DEBUG",
+};
+
+#define LOGBUFSIZE 65536
+#define LOGRECSIZE 1024     // maximum size of a record
+#define LOGSTRSIZE 255      // maximum length of a string argument
+
+static __thread uchar log_buf[LOGBUFSIZE];
+static __thread uint log_len = 0;
+
+// sets the log level by name (none, error, warning or debug)
+int log_setlevel(const char *name) {
+    for (uint i = 0; i < ALEN(log_names); i++)
+        if (strcasecmp(name, log_names[i]) == 0) {
+            log_level = i;
+            log_level_set = true;
+            return 0;
+        }
+    return -1;
+}
+
+// takes the log level from the environment variable OPFS_LOG unless it
+// has been set explicitly
+static void log_init(void) {
+    static bool done = false;
+    if (done)
+        return;
+    done = true;
+    char *name = getenv("OPFS_LOG");
+    if (!log_level_set && name != NULL && log_setlevel(name) < 0)
+        error("OPFS_LOG: %s: unknown log level\n", name);
+    atexit(log_flush);
+}
+
+// skips the flags, width, precision and length modifiers of a conversion
+// specification p (following '%'); returns the conversion character, and
+// sets *modp to the length modifiers and *longp to whether the argument is
+// a long (or size_t)
+static const char *log_spec(const char *p, const char **modp, bool *longp) {
+    while (*p != 0 && strchr("-+ #0123456789.", *p) != NULL)
+        p++;
+    *modp = p;
+    *longp = false;
+    for (; *p == 'l' || *p == 'z' || *p == 'h'; p++)
+        *longp |= *p != 'h';
+    return p;
+}
+
+// a record is the level, the # of arguments recorded, the size of the
+// record (a ushort), the format and the arguments; those that do not fit
+// in LOGRECSIZE are not recorded
+void log_message(int level, const char *fmt, ...) {
+    uchar rec[LOGRECSIZE];
+    uint n = 0;
+    rec[n++] = level;
+    uint nargs = 0;
+    n += 1 + sizeof(ushort);
+    memcpy(rec + n, &fmt, sizeof(fmt));
+    n += sizeof(fmt);
     va_list args;
     va_start(args, fmt);
-    fprintf(stderr, "%s: ", tag);
-    vfprintf(stderr, fmt, args);
+    for (const char *p = fmt; *p != 0; p++) {
+        if (*p != '%')
+            continue;
+        const char *mod;
+        bool l;
+        p = log_spec(p + 1, &mod, &l);
+        if (*p == 0)
+            break;
+        if (n + 1 + LOGSTRSIZE > LOGRECSIZE)
+            break;
+        uint64 v;
+        if (*p == 's') {
+            const char *str = va_arg(args, const char *);
+            size_t len = str == NULL ? 0 : strlen(str);
+            len = len < LOGSTRSIZE ? len : LOGSTRSIZE;
+            rec[n++] = len;
+            memcpy(rec + n, str, len);
+            n += len;
+            nargs++;
+            continue;
+        }
+        else if (*p == 'p')
+            v = (uintptr_t)va_arg(args, void *);
+        else if (*p == 'd' || *p == 'i')
+            v = l ? (uint64)va_arg(args, long) : (uint64)va_arg(args, int);
+        else if (*p != 0 && strchr("uxXoc", *p) != NULL)
+            v = l ? va_arg(args, unsigned long) : va_arg(args, uint);
+        else
+            continue;
+        memcpy(rec + n, &v, sizeof(v));
+        n += sizeof(v);
+        nargs++;
+    }
     va_end(args);
-#endif
+    rec[1] = nargs;
+    ushort size = n;
+    memcpy(rec + 2, &size, sizeof(size));
+    if (log_len + n > LOGBUFSIZE)
+        log_flush();
+    memcpy(log_buf + log_len, rec, n);
+    log_len += n;
+}
+
+// formats the records in the buffer of the calling thread and writes them
+// to stderr at once
+void log_flush(void) {
+    static __thread char out[LOGBUFSIZE];
+    uint m = 0;
+    for (uint i = 0, start = 0; i < log_len; i = start) {
+        int level = log_buf[i++];
+        uint nargs = log_buf[i++];
+        ushort size;
+        memcpy(&size, log_buf + i, sizeof(size));
+        i += sizeof(size);
+        // the arguments left when the output is cut off are skipped
+        start += size;
+        const char *fmt;
+        memcpy(&fmt, log_buf + i, sizeof(fmt));
+        i += sizeof(fmt);
+        if (m + 2 * LOGRECSIZE > sizeof(out)) {
+            fwrite(out, 1, m, stderr);
+            m = 0;
+        }
+        char *end = out + m + LOGRECSIZE;  // end of the room for the record
+        char *o = out + m;
+        o += snprintf(o, end - o, "%s: ", log_names[level]);
+        for (const char *p = fmt; *p != 0 && o < end - 1; p++) {
+            if (*p != '%') {
+                *o++ = *p;
+                continue;
+            }
+            const char *mod;
+            bool l;
+            const char *q = log_spec(p + 1, &mod, &l);
+            if (*q == 0)
+                break;
+            // integers are printed as long longs
+            char spec[32];
+            bool integer = strchr("diuxXo", *q) != NULL;
+            snprintf(spec, sizeof(spec), "%%%.*s%s%c",
+                     (int)min(mod - (p + 1), 16), p + 1,
+                     integer ? "ll" : "", *q);
+            // the arguments that were not recorded are printed as '?'
+            bool arg = strchr("spdiuxXoc", *q) != NULL;
+            if (arg && nargs == 0) {
+                *o++ = '?';
+                p = q;
+                continue;
+            }
+            nargs -= arg;
+            uint64 v = 0;
+            if (*q == 's') {
+                char str[LOGSTRSIZE + 1];
+                uint len = log_buf[i++];
+                memcpy(str, log_buf + i, len);
+                str[len] = 0;
+                i += len;
+                o += snprintf(o, end - o, spec, str);
+            }
+            else if (*q == '%')
+                *o++ = '%';
+            else if (strchr("pdiuxXoc", *q) != NULL) {
+                memcpy(&v, log_buf + i, sizeof(v));
+                i += sizeof(v);
+                if (*q == 'p')
+                    o += snprintf(o, end - o, spec, (void *)(uintptr_t)v);
+                else if (*q == 'c')
+                    o += snprintf(o, end - o, spec, (int)v);
+                else if (*q == 'd' || *q == 'i')
+                    o += snprintf(o, end - o, spec, (long long)v);
+                else
+                    o += snprintf(o, end - o, spec, (unsigned long long)v);
+            }
+            p = q;
+        }
+        // a record cut off still ends its line
+        if (o >= end - 1) {
+            o = end - 1;
+            *o++ = '\n';
+        }
+        m = o - out;
+    }
+    fwrite(out, 1, m, stderr);
+    log_len = 0;
 }
 
 void error(const char *fmt, ...) {
+    log_flush();
     va_list args;
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
@@ -133,14 +353,243 @@ void error(const char *fmt, ...) {
 }
 
 void fatal(const char *fmt, ...) {
+    log_flush();
     va_list args;
     va_start(args, fmt);
     fprintf(stderr, "FATAL: ");
     vfprintf(stderr, fmt, args);
     va_end(args);
+    trace_depth = 0;
+    nidirty = 0;
     longjmp(fatal_exception_buf, 1);
 }
 
+
+/*
+ * Operation trace
+ */
+
+// the trace is written to trace_file if it is not NULL
+FILE *trace_file = NULL;
+
+// opens (or creates) a trace file to which records are appended
+int trace_open(char *path) {
+    FILE *fp = fopen(path, "ab");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) == 0) {
+        uint magic = TRACE_MAGIC;
+        fwrite(&magic, sizeof(magic), 1, fp);
+    }
+    // each process starts with fresh allocation hints, which replay
+    // resets at this record
+    struct trace_rec rec = { .op = TR_SESSION };
+    fwrite(&rec, sizeof(rec), 1, fp);
+    trace_file = fp;
+    return 0;
+}
+
+int trace_close(void) {
+    if (trace_file == NULL)
+        return 0;
+    int r = fclose(trace_file);
+    trace_file = NULL;
+    return r;
+}
+
+/*
+ * Performance counters
+ */
+
+bool perf_enabled = false;
+__thread uint64 perf_counters[NPERFCOUNTERS];
+
+const char *perf_names[NPERFCOUNTERS] = {
+    [PC_BITMAP_BITS] = "bitmap bits scanned",
+    [PC_BALLOC] = "blocks allocated",
+    [PC_BFREE] = "blocks freed",
+    [PC_INODE_PROBES] = "inode slots probed",
+    [PC_DIRENT_CMPS] = "dirents compared",
+    [PC_BMAP] = "bmap calls",
+    [PC_INDIRECT] = "indirect lookups",
+    [PC_INDIRECT_HITS] = "indirect cache hits",
+    [PC_BYTES_COPIED] = "bytes copied",
+    [PC_IREAD] = "iread calls",
+    [PC_IWRITE] = "iwrite calls",
+    [PC_READAHEAD] = "blocks read ahead",
+};
+
+/*
+ * Latency histograms
+ */
+
+bool lat_enabled = false;
+__thread struct histogram lat_histograms[NLATOPS];
+
+const char *lat_names[NLATOPS] = {
+    [LAT_ILOOKUP] = "ilookup",
+    [LAT_ICREAT] = "icreat",
+    [LAT_IUNLINK] = "iunlink",
+    [LAT_IREAD] = "iread",
+    [LAT_IWRITE] = "iwrite",
+    [LAT_ITRUNCATE] = "itruncate",
+    [LAT_BALLOC] = "balloc",
+    [LAT_IALLOC] = "ialloc",
+};
+
+// the bucket of a value: values below 16 have their own buckets, and
+// each following power of 2 is divided into 8 buckets
+static uint hist_bucket(uint64 v) {
+    if (v < 16)
+        return v;
+    uint e = 63 - __builtin_clzll(v);   // 4 <= e <= 63
+    return 16 + (e - 4) * 8 + ((v >> (e - 3)) & 7);
+}
+
+// the largest value in bucket i
+static uint64 hist_upper(uint i) {
+    if (i < 16)
+        return i;
+    uint e = (i - 16) / 8 + 4;
+    uint64 lo = (uint64)(8 + (i - 16) % 8) << (e - 3);
+    return lo + ((uint64)1 << (e - 3)) - 1;
+}
+
+// returns the q-quantile (0 <= q <= 1) of the values in h
+uint64 hist_quantile(const struct histogram *h, double q) {
+    if (h->count == 0)
+        return 0;
+    uint64 rank = (uint64)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    uint64 c = 0;
+    for (uint i = 0; i < NLATBUCKETS; i++) {
+        c += h->buckets[i];
+        if (c > rank)
+            return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+    }
+    return h->max;
+}
+
+// prints the histograms of the operations called at least once
+void lat_report(FILE *fp) {
+    fprintf(fp, "%-11s %10s %10s %10s %10s %10s %10s\n", "latency(ns)",
+            "count", "mean", "p50", "p99", "p999", "max");
+    for (uint op = 0; op < NLATOPS; op++) {
+        struct histogram *h = &lat_histograms[op];
+        if (h->count == 0)
+            continue;
+        fprintf(fp, "%-11s %10lu %10lu %10lu %10lu %10lu %10lu\n",
+                lat_names[op], h->count, h->sum / h->count,
+                hist_quantile(h, 0.5), hist_quantile(h, 0.99),
+                hist_quantile(h, 0.999), h->max);
+    }
+}
+
+static inline uint64 lat_start(void) {
+    if (!lat_enabled)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void lat_end(uint op, uint64 t0) {
+    if (!lat_enabled)
+        return;
+    uint64 v = lat_start() - t0;
+    struct histogram *h = &lat_histograms[op];
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+    h->buckets[hist_bucket(v)]++;
+}
+
+/*
+ * Block access trace
+ */
+
+FILE *blktrace_file = NULL;
+
+// opens (or creates) a block trace file to which records are appended
+int blktrace_open(char *path) {
+    FILE *fp = fopen(path, "ab");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) == 0) {
+        uint magic = BLKTRACE_MAGIC;
+        fwrite(&magic, sizeof(magic), 1, fp);
+    }
+    blktrace_file = fp;
+    return 0;
+}
+
+int blktrace_close(void) {
+    if (blktrace_file == NULL)
+        return 0;
+    int r = fclose(blktrace_file);
+    blktrace_file = NULL;
+    return r;
+}
+
+// records an access to block b; blocks preceding the data blocks are
+// always metadata
+static void blktrace(img_t img, uint b, uint flags) {
+    struct superblock *sb = SBLK(img);
+    struct blktrace_rec rec;
+    rec.block = b;
+    rec.flags = b < sb->size - sb->nblocks ? flags | BA_META : flags;
+    fwrite(&rec, sizeof(rec), 1, blktrace_file);
+}
+
+#define BTRACE(img, b, flags) \
+    do { if (blktrace_file != NULL) blktrace(img, b, flags); } while (0)
+
+// records that the i-node ip has been modified
+static void idirty(img_t img, inode_t ip) {
+    if (blktrace_file == NULL)
+        return;
+    uint b = IBLK(img, geti(img, ip));
+    for (uint i = 0; i < nidirty; i++)
+        if (idirty_blocks[i] == b)
+            return;
+    if (trace_depth == 0 || nidirty == NIDIRTY)
+        blktrace(img, b, BA_WRITE);
+    else
+        idirty_blocks[nidirty++] = b;
+}
+
+// records the writes of the i-node blocks modified by the operation that
+// has just returned, if it is the outermost one
+static void idirty_flush(img_t img) {
+    if (trace_depth > 0)
+        return;
+    for (uint i = 0; i < nidirty; i++)
+        blktrace(img, idirty_blocks[i], BA_WRITE);
+    nidirty = 0;
+}
+
+static void trace(uint op, uint inum, char *path, uint off, uint n, int res) {
+    struct trace_rec rec = { 0 };
+    rec.op = op;
+    size_t len = path == NULL ? 0 : strlen(path);
+    rec.pathlen = len < 0xffff ? len : 0xffff;
+    rec.inum = inum;
+    rec.off = off;
+    rec.n = n;
+    rec.res = res;
+    fwrite(&rec, sizeof(rec), 1, trace_file);
+    if (path != NULL)
+        fwrite(path, 1, rec.pathlen, trace_file);
+}
+
 char *typename(int type) {
     switch (type) {
     case T_DIR:
@@ -155,39 +604,592 @@ char *typename(int type) {
 }
 
 
+/*
+ * Block allocation policies
+ */
+
+int balloc_policy = BP_FIRST_FIT;
+static bool balloc_policy_set = false;  // set explicitly (not by OPFS_BALLOC)
+
+const char *balloc_policy_names[] = {
+    [BP_FIRST_FIT] = "first-fit",
+    [BP_NEXT_FIT] = "next-fit",
+    [BP_BEST_FIT] = "best-fit",
+    [BP_GOAL] = "goal",
+};
+
+// sets the block allocation policy by name; returns -1 if it is unknown
+int balloc_setpolicy(const char *name) {
+    for (uint i = 0; i < NBPOLICIES; i++)
+        if (strcasecmp(name, balloc_policy_names[i]) == 0) {
+            balloc_policy = i;
+            balloc_policy_set = true;
+            return 0;
+        }
+    return -1;
+}
+
+// takes the block allocation policy from the environment variable
+// OPFS_BALLOC unless it has been set explicitly
+static void balloc_init(void) {
+    static bool done = false;
+    if (done)
+        return;
+    done = true;
+    char *name = getenv("OPFS_BALLOC");
+    if (!balloc_policy_set && name != NULL && balloc_setpolicy(name) < 0)
+        error("OPFS_BALLOC: %s: unknown allocation policy\n", name);
+}
+
+/*
+ * Readahead
+ */
+
+// off by default: the advice only pays on images whose blocks are slow to
+// read, and costs time when they are cached
+uint readahead_window = 0;
+static bool readahead_window_set = false;  // set explicitly
+static size_t pagesize;
+
+void readahead_setwindow(uint n) {
+    readahead_window = n;
+    readahead_window_set = true;
+}
+
+// takes the readahead window from the environment variable
+// OPFS_READAHEAD unless it has been set explicitly
+static void readahead_init(void) {
+    static bool done = false;
+    if (done)
+        return;
+    done = true;
+    pagesize = sysconf(_SC_PAGESIZE);
+    char *s = getenv("OPFS_READAHEAD"), *end;
+    if (readahead_window_set || s == NULL)
+        return;
+    unsigned long n = strtoul(s, &end, 10);
+    if (*s == 0 || *end != 0 || n > 0xffffffffUL)
+        error("OPFS_READAHEAD: %s: invalid number of blocks\n", s);
+    else
+        readahead_window = n;
+}
+
+// pages of the image at ra_base already advised, so that the blocks
+// reached again through other directories are not advised again
+static uchar *ra_advised = NULL;
+static const uchar *ra_base = NULL;
+
+// advises that the n blocks from b are about to be read, so that those
+// of a file-backed image are read in the background
+void breadahead(img_t img, uint b, uint n) {
+    if (readahead_window == 0 || n == 0 || pagesize == 0)
+        return;
+    size_t start = (size_t)b << img->bshift;
+    size_t end = (size_t)(b + n) << img->bshift;
+    if (start >= img->size)
+        return;
+    if (end > img->size)
+        end = img->size;
+    // pages are numbered from the one containing the image base
+    uintptr_t p0 = (uintptr_t)img->base / pagesize;
+    if (ra_base != img->base) {
+        free(ra_advised);
+        size_t npages = ((uintptr_t)img->base + img->size - 1) / pagesize - p0;
+        ra_advised = calloc(npages / 8 + 1, 1);
+        ra_base = ra_advised != NULL ? img->base : NULL;
+    }
+    uintptr_t first = (uintptr_t)(img->base + start) / pagesize - p0;
+    uintptr_t last = (uintptr_t)(img->base + end - 1) / pagesize - p0;
+    if (ra_advised == NULL) {
+        posix_madvise((void *)((p0 + first) * pagesize),
+                      (last - first + 1) * pagesize, POSIX_MADV_WILLNEED);
+        PERF_ADD(PC_READAHEAD, n);
+        return;
+    }
+    // the pages not advised yet are advised in runs
+    uintptr_t run = first;
+    for (uintptr_t p = first; p <= last + 1; p++) {
+        if (p <= last && !(ra_advised[p / 8] & (1 << (p % 8)))) {
+            ra_advised[p / 8] |= 1 << (p % 8);
+            continue;
+        }
+        if (run < p) {
+            posix_madvise((void *)((p0 + run) * pagesize),
+                          (p - run) * pagesize, POSIX_MADV_WILLNEED);
+            PERF_ADD(PC_READAHEAD,
+                     umin(n, divceil((p - run) * pagesize, img->bsize)));
+        }
+        run = p + 1;
+    }
+}
+
+/*
+ * Disk image geometry
+ */
+
+// supported format variants (the first one is the default)
+const struct fsformat fsformats[] = {
+    { "xv6-riscv", 1024, true, 0 },
+    { "xv6-x86", 512, false, -(int)sizeof(uint) },
+};
+const uint nfsformats = ALEN(fsformats);
+
+// returns the format variant named name, or NULL if there is none
+const struct fsformat *findformat(char *name) {
+    for (uint i = 0; i < nfsformats; i++)
+        if (strcmp(name, fsformats[i].name) == 0)
+            return &fsformats[i];
+    return NULL;
+}
+
+// checks if bsize is a supported block size
+bool valid_bsize(uint bsize) {
+    return MINBSIZE <= bsize && bsize <= MAXBSIZE && bitcount(bsize) == 1;
+}
+
+// sets the default options of a file system to be made
+void fsopts_init(struct fsopts *o) {
+    o->fmt = &fsformats[0];
+    o->bsize = 0;
+    o->features = 0;
+}
+
+// parses the option argv[*ip] if it is one of the options of a file
+// system to be made (--format, --bsize, --dindirect, --extents, --inline,
+// --dir-index and --wide-inum), leaving *ip at its last argument; returns
+// 1 if it is, 0 if it is not, and -1 if it is invalid
+int fsopts_parse(struct fsopts *o, int argc, char *argv[], int *ip) {
+    static const struct { char *name; uint feature; } flags[] = {
+        { "--dindirect", FS_DINDIRECT },
+        { "--extents", FS_EXTENTS },
+        { "--inline", FS_INLINE },
+        { "--dir-index", FS_DIRINDEX },
+        { "--wide-inum", FS_WIDEINUM },
+    };
+    int i = *ip;
+    for (uint k = 0; k < ALEN(flags); k++)
+        if (strcmp(argv[i], flags[k].name) == 0) {
+            o->features |= flags[k].feature;
+            return 1;
+        }
+    if (i + 1 >= argc)
+        return 0;
+    if (strcmp(argv[i], "--format") == 0) {
+        if ((o->fmt = findformat(argv[i + 1])) == NULL) {
+            error("%s: %s: unknown format\n", progname, argv[i + 1]);
+            return -1;
+        }
+    }
+    else if (strcmp(argv[i], "--bsize") == 0) {
+        // strtoul would take leading spaces and a sign
+        char *arg = argv[i + 1], *end;
+        unsigned long n = strtoul(arg, &end, 10);
+        if (*arg < '0' || *arg > '9' || *end != 0 || n == 0 ||
+            n > UINT_MAX) {
+            error("%s: %s: invalid block size\n", progname, arg);
+            return -1;
+        }
+        o->bsize = n;
+    }
+    else
+        return 0;
+    *ip = i + 1;
+    return 1;
+}
+
+// checks the options of a file system to be made, setting the default
+// block size; returns -1 if they are invalid
+int fsopts_check(struct fsopts *o) {
+    if (o->bsize == 0)
+        o->bsize = o->fmt->bsize;
+    if (!valid_bsize(o->bsize)) {
+        error("%s: %u: block size must be a power of 2 between %d and %d\n",
+              progname, o->bsize, MINBSIZE, MAXBSIZE);
+        return -1;
+    }
+    if ((o->features & FS_DINDIRECT) && (o->features & FS_EXTENTS)) {
+        error("%s: --dindirect and --extents are exclusive\n", progname);
+        return -1;
+    }
+    return 0;
+}
+
+// checks if a file system made with the options o can have ninodes
+// inodes
+int fsopts_check_inodes(const struct fsopts *o, uint64 ninodes) {
+    if (!(o->features & FS_WIDEINUM) && ninodes > 0x10000) {
+        error("%s: more than 65536 inodes require --wide-inum\n", progname);
+        return -1;
+    }
+    return 0;
+}
+
+// creates an image file of size bytes and maps it into memory; returns
+// its address and sets *fdp to the file descriptor, or returns NULL
+uchar *createimg(char *file, uint64 size, int *fdp) {
+    if (size != (size_t)size || (off_t)size < 0) {
+        error("%s: %lu bytes: image too large\n", file, size);
+        return NULL;
+    }
+    int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(file);
+        return NULL;
+    }
+    char c = 0;
+    if (lseek(fd, size - 1, SEEK_SET) < 0 || write(fd, &c, 1) < 0) {
+        perror(file);
+        close(fd);
+        return NULL;
+    }
+    uchar *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror(file);
+        close(fd);
+        return NULL;
+    }
+    *fdp = fd;
+    return base;
+}
+
+// resets the allocation hints of img to those of a newly opened image
+void resethints(img_t img) {
+    img->bhint = 0;
+    img->ihint = 1;
+    img->bnext = 0;
+    img->bgoal_ip = NULL;
+    img->bgoal = 0;
+    img->bcache_ip = NULL;
+}
+
+// sets up img for the image in format fmt of size bytes at base with
+// block size bsize
+int initimg(img_t img, const struct fsformat *fmt, uchar *base, size_t size,
+            uint bsize, uint features) {
+    log_init();
+    balloc_init();
+    readahead_init();
+    if (!valid_bsize(bsize)) {
+        derror("initimg: %u: invalid block size\n", bsize);
+        return -1;
+    }
+    img->fmt = fmt;
+    img->base = base;
+    img->size = size;
+    img->bsize = bsize;
+    img->bshift = bitcount(bsize - 1);
+    img->ipb = bsize / sizeof(struct dinode);
+    img->bpb = bsize * 8;
+    img->nindirect = bsize / sizeof(uint);
+    img->features = features;
+    img->dirsiz = (features & FS_WIDEINUM) ? WDIRSIZ : DIRSIZ;
+    if ((features & FS_DINDIRECT) && (features & FS_EXTENTS)) {
+        derror("initimg: extents cannot be combined with indirect blocks\n");
+        return -1;
+    }
+    // with FS_DINDIRECT, the last direct block is turned into the
+    // double-indirect block
+    img->ndirect = (features & FS_DINDIRECT) ? NDIRECT - 1 : NDIRECT;
+    uint64 maxfile = img->ndirect + img->nindirect;
+    if (features & FS_DINDIRECT)
+        maxfile += (uint64)img->nindirect * img->nindirect;
+    // the size of an extent-based file is bounded only by the number of
+    // its extents
+    if (features & FS_EXTENTS)
+        maxfile = 0xffffffffU;
+    // file sizes are 32-bit
+    if (maxfile > 0xffffffffU / bsize)
+        maxfile = 0xffffffffU / bsize;
+    img->maxfile = maxfile;
+    img->maxfilesize = img->maxfile * bsize;
+    img->bpolicy = balloc_policy;
+    img->bclean = false;
+    resethints(img);
+    return 0;
+}
+
+// checks if the superblock of img describes the layout made by mkfs
+static bool valid_layout(img_t img) {
+    struct superblock *sb = SBLK(img);
+    uint ni = sb->ninodes / img->ipb + 1;
+    uint nm = sb->size / img->bpb + 1;
+    return sb->size > 2 && sb->ninodes > 0 &&
+        (uint64)sb->size * img->bsize <= img->size &&
+        sb->logstart == 2 && sb->inodestart == sb->logstart + sb->nlog &&
+        sb->bmapstart == sb->inodestart + ni &&
+        (uint64)sb->bmapstart + nm + sb->nblocks == sb->size;
+}
+
+// sets up img for the image of size bytes at base, finding the format
+// and the block size by looking for a superblock that records them.  A
+// format without a magic number is recognized by its layout.
+int loadimg(img_t img, uchar *base, size_t size) {
+    for (uint i = 0; i < nfsformats; i++) {
+        const struct fsformat *fmt = &fsformats[i];
+        for (uint bsize = MINBSIZE; bsize <= MAXBSIZE; bsize *= 2) {
+            if (size < 2 * (size_t)bsize)
+                break;
+            struct superblock *sb =
+                (struct superblock *)(base + bsize + fmt->sboff);
+            uint sbsize = sb->bsize != 0 ? sb->bsize : fmt->bsize;
+            if (sbsize != bsize || (fmt->magic && sb->magic != FSMAGIC))
+                continue;
+            if (initimg(img, fmt, base, size, bsize, sb->features) == 0 &&
+                (fmt->magic || valid_layout(img)))
+                return 0;
+        }
+    }
+    return -1;
+}
+
+// makes an empty file system of size blocks in img
+int mkfs(img_t img, uint size, uint ninodes, uint nlog) {
+    uint niblocks = ninodes / img->ipb + 1;
+    uint nmblocks = size / img->bpb + 1;
+    uint dstart = 2 + nlog + niblocks + nmblocks;
+    if (dstart >= size || (uint64)size * img->bsize > img->size) {
+        derror("mkfs: %u: too few blocks\n", size);
+        return -1;
+    }
+
+    // clear the blocks before the data blocks (the data blocks of a new
+    // image file are already zero, and touching them all would make the
+    // image file no longer sparse)
+    memset(img->base, 0, (size_t)dstart * img->bsize);
+
+    // setup superblock (the opfs extension fields are left zero when
+    // they have the default values, as in images made by xv6's mkfs)
+    struct superblock *sb = SBLK(img);
+    if (img->fmt->magic)
+        sb->magic = FSMAGIC;
+    sb->size = size;
+    sb->nblocks = size - dstart;
+    sb->ninodes = ninodes;
+    sb->nlog = nlog;
+    sb->logstart = 2;
+    sb->inodestart = 2 + nlog;
+    sb->bmapstart = 2 + nlog + niblocks;
+    sb->bsize = img->bsize != img->fmt->bsize ? img->bsize : 0;
+    sb->features = img->features;
+
+    // setup initial bitmap
+    for (uint b = 0; b < dstart; b += img->bpb) {
+        uchar *bp = BLK(img, BBLK(img, b));
+        for (uint bi = 0; bi < img->bpb && b + bi < dstart; bi++) {
+            int m = 1 << (bi % 8);
+            bp[bi / 8] |= m;
+        }
+    }
+
+    // setup root directory
+    inode_t rp = ialloc(img, T_DIR);
+    assert(geti(img, rp) == root_inode_number);
+    daddent(img, rp, ".", rp);
+    daddent(img, rp, "..", rp);
+    return 0;
+}
+
+
+// the # of blocks of a file system with ndata data blocks, ninodes inodes
+// and nlog log blocks (the inverse of the layout made by mkfs)
+uint fssize(img_t img, uint ndata, uint ninodes, uint nlog) {
+    uint nmeta = 2 + nlog + ninodes / img->ipb + 1;
+    uint nmblocks = 1;
+    while ((nmeta + nmblocks + ndata) / img->bpb + 1 != nmblocks)
+        nmblocks = (nmeta + nmblocks + ndata) / img->bpb + 1;
+    return nmeta + nmblocks + ndata;
+}
+
 /*
  * Basic operations on blocks
  */
 
-// checks if b is a valid data block number
-bool valid_data_block(img_t img, uint b) {
+// sets the range [*lop, *hip) of the data block numbers
+static inline void data_blocks(img_t img, uint *lop, uint *hip) {
     const uint Nl = SBLK(img)->nlog;                    // # of log blocks
-    const uint Ni = SBLK(img)->ninodes / IPB + 1;       // # of inode blocks
-    const uint Nm = SBLK(img)->size / (BSIZE * 8) + 1;  // # of bitmap blocks
+    const uint Ni = SBLK(img)->ninodes / img->ipb + 1;  // # of inode blocks
+    const uint Nm = SBLK(img)->size / img->bpb + 1;     // # of bitmap blocks
     const uint Nd = SBLK(img)->nblocks;                 // # of data blocks
-    const uint d = 2 + Nl + Ni + Nm;                    // 1st data block number
-    return d <= b && b <= d + Nd - 1;
+    *lop = 2 + Nl + Ni + Nm;                            // 1st data block number
+    *hip = *lop + Nd;
 }
 
-// allocates a new data block and returns its block number
-uint balloc(img_t img) {
-    for (uint b = 0; b < SBLK(img)->size; b += BPB) {
-        uchar *bp = img[BBLOCK(b, SBLKS(img))];
-        for (uint bi = 0; bi < BPB && b + bi < SBLK(img)->size; bi++) {
-            int m = 1 << (bi % 8);
-            if ((bp[bi / 8] & m) == 0) {
-                bp[bi / 8] |= m;
-                if (!valid_data_block(img, b + bi)) {
-                    fatal("balloc: %u: invalid data block number\n", b + bi);
-                    return 0; // dummy
-                }
-                memset(img[b + bi], 0, BSIZE);
-                return b + bi;
+// checks if b is a valid data block number
+bool valid_data_block(img_t img, uint b) {
+    uint lo, hi;
+    data_blocks(img, &lo, &hi);
+    return lo <= b && b < hi;
+}
+
+// returns the first free block in [from, to), or 0 if there is none
+static uint bscan(img_t img, uint from, uint to) {
+    for (uint b = from; b < to; ) {
+        uchar *bp = BLK(img, BBLK(img, b));
+        BTRACE(img, BBLK(img, b), 0);
+        for (uint bi = b % img->bpb; bi < img->bpb && b < to; bi++, b++)
+            if ((bp[bi / 8] & (1 << (bi % 8))) == 0) {
+                PERF_ADD(PC_BITMAP_BITS, b - from + 1);
+                return b;
+            }
+    }
+    PERF_ADD(PC_BITMAP_BITS, to - from);
+    return 0;
+}
+
+// returns the first block of a run of at least n free data blocks in
+// [from, to), or of the shortest such run if best is true; returns 0 if
+// there is none
+static uint brun(img_t img, uint n, uint from, uint to, bool best) {
+    uint dlo, dhi;
+    data_blocks(img, &dlo, &dhi);
+    uint found = 0, flen = 0;
+    uint run = 0;  // length of the current run of free blocks
+    for (uint b = from; b <= to; b++) {
+        bool isfree = false;
+        if (b < to) {
+            uchar *bp = BLK(img, BBLK(img, b));
+            uint bi = b % img->bpb;
+            if (bi == 0 || b == from)
+                BTRACE(img, BBLK(img, b), 0);
+            isfree = (bp[bi / 8] & (1 << (bi % 8))) == 0 &&
+                dlo <= b && b < dhi;
+        }
+        if (isfree) {
+            if (++run == n && !best) {
+                PERF_ADD(PC_BITMAP_BITS, b - from + 1);
+                return b - n + 1;
             }
+            continue;
+        }
+        if (run >= n && (flen == 0 || run < flen)) {
+            found = b - run;
+            flen = run;
+            if (run == n)
+                break;
+        }
+        run = 0;
+    }
+    PERF_ADD(PC_BITMAP_BITS, to - from);
+    return found;
+}
+
+// gap left by the goal policy before a file whose next block has been
+// taken, so that files growing at the same time are not interleaved
+#define BGOAL_GAP 8
+
+// # of blocks from the one following the last allocated in which the
+// best-fit policy looks for the shortest run of free blocks
+#define BFIT_WINDOW 256
+
+// returns the block where the allocation policy of img starts searching
+// for a block near goal (0 if there is no goal); follow tells that goal
+// is the block following one of the same file
+static uint bstart(img_t img, uint goal, bool follow) {
+    uint N = SBLK(img)->size;
+    uint start = 0;
+    switch (img->bpolicy) {
+    case BP_NEXT_FIT:
+        start = img->bnext;
+        break;
+    case BP_GOAL:
+        start = goal != 0 ? goal : img->bnext;
+        if (follow && start < N && bscan(img, start, start + 1) != start) {
+            uint r = brun(img, 2 * BGOAL_GAP, start, N, false);
+            if (r != 0)
+                start = r + BGOAL_GAP;
         }
+        break;
+    case BP_BEST_FIT:
+        if (goal != 0 && goal < N && bscan(img, goal, goal + 1) == goal)
+            return goal;
+        // the search is bounded; if the window is full, the first free
+        // block after it is taken
+        start = img->bnext < N ? img->bnext : 0;
+        uint end = umin((uint64)start + BFIT_WINDOW, N);
+        uint r = brun(img, 1, start, end, true);
+        start = r != 0 ? r : end;
+        break;
+    }
+    return start < N ? start : 0;
+}
+
+// allocates a new data block near goal (0 if there is none) by the
+// allocation policy of img and returns its block number (see bstart for
+// follow)
+// if img->bhint is set, the search starts there instead and the hint
+// follows the allocated blocks, so that successive allocations are laid
+// out in order
+static uint do_balloc(img_t img, uint goal, bool follow) {
+    uint N = SBLK(img)->size;
+    uint start = img->bhint != 0 ? (img->bhint < N ? img->bhint : 0)
+        : bstart(img, goal, follow);
+    uint b = bscan(img, start, N);
+    if (b == 0)
+        b = bscan(img, 0, start);
+    if (b == 0) {
+        fatal("balloc: no free blocks\n");
+        return 0; // dummy
+    }
+    uchar *bp = BLK(img, BBLK(img, b));
+    uint bi = b % img->bpb;
+    bp[bi / 8] |= 1 << (bi % 8);
+    BTRACE(img, BBLK(img, b), BA_WRITE);
+    if (!valid_data_block(img, b)) {
+        fatal("balloc: %u: invalid data block number\n", b);
+        return 0; // dummy
     }
-    fatal("balloc: no free blocks\n");
-    return 0; // dummy
+    if (!img->bclean)
+        memset(BLK(img, b), 0, img->bsize);
+    if (img->bhint != 0)
+        img->bhint = b + 1;
+    img->bnext = b + 1;
+    PERF_ADD(PC_BALLOC, 1);
+    return b;
+}
+
+static uint balloc_goal(img_t img, uint goal, bool follow) {
+    uint64 t0 = lat_start();
+    uint b = do_balloc(img, goal, follow);
+    lat_end(LAT_BALLOC, t0);
+    return b;
+}
+
+uint balloc(img_t img) {
+    return balloc_goal(img, 0, false);
+}
+
+uint balloc_near(img_t img, uint goal) {
+    return balloc_goal(img, goal, false);
+}
+
+// returns the first block of a run of n free data blocks chosen by the
+// allocation policy of img (near goal if it is not 0), or 0 if there is
+// no such run
+static uint bfind(img_t img, uint n, uint goal) {
+    uint N = SBLK(img)->size;
+    if (n == 0)
+        return 0;
+    uint start = 0;
+    switch (img->bpolicy) {
+    case BP_BEST_FIT:
+        return brun(img, n, 0, N, true);
+    case BP_NEXT_FIT:
+        start = img->bnext;
+        break;
+    case BP_GOAL:
+        start = goal != 0 ? goal : img->bnext;
+        break;
+    }
+    if (start >= N)
+        start = 0;
+    uint b = brun(img, n, start, N, false);
+    if (b == 0 && start > 0)
+        b = brun(img, n, 0, start, false);
+    return b;
+}
+
+uint bfind_run(img_t img, uint n) {
+    return bfind(img, n, 0);
 }
 
 // frees the block specified by b
@@ -196,16 +1198,39 @@ int bfree(img_t img, uint b) {
         derror("bfree: %u: invalid data block number\n", b);
         return -1;
     }
-    uchar *bp = img[BBLOCK(b, SBLKS(img))];
-    int bi = b % BPB;
+    uchar *bp = BLK(img, BBLK(img, b));
+    int bi = b % img->bpb;
     int m = 1 << (bi % 8);
     if ((bp[bi / 8] & m) == 0)
         dwarn("bfree: %u: already freed block\n", b);
     bp[bi / 8] &= ~m;
+    BTRACE(img, BBLK(img, b), BA_WRITE);
+    if (img->bclean)
+        memset(BLK(img, b), 0, img->bsize);
+    PERF_ADD(PC_BFREE, 1);
     return 0;
 }
 
 
+// allocates the data block b if it is free
+bool balloc_at(img_t img, uint b) {
+    if (b >= SBLK(img)->size || !valid_data_block(img, b))
+        return false;
+    uchar *bp = BLK(img, BBLK(img, b));
+    uint bi = b % img->bpb;
+    if ((bp[bi / 8] & (1 << (bi % 8))) != 0) {
+        BTRACE(img, BBLK(img, b), 0);
+        return false;
+    }
+    bp[bi / 8] |= 1 << (bi % 8);
+    BTRACE(img, BBLK(img, b), BA_WRITE);
+    if (!img->bclean)
+        memset(BLK(img, b), 0, img->bsize);
+    PERF_ADD(PC_BALLOC, 1);
+    return true;
+}
+
+
 /*
  * Basic operations on files (inodes)
  */
@@ -216,170 +1241,602 @@ inode_t root_inode;
 
 // returns the pointer to the inum-th dinode structure
 inode_t iget(img_t img, uint inum) {
-    if (0 < inum && inum < SBLK(img)->ninodes)
-        return (inode_t)img[IBLOCK(inum, SBLKS(img))] + inum % IPB;
+    if (0 < inum && inum < SBLK(img)->ninodes) {
+        BTRACE(img, IBLK(img, inum), 0);
+        return (inode_t)BLK(img, IBLK(img, inum)) + inum % img->ipb;
+    }
     derror("iget: %u: invalid inode number\n", inum);
     return NULL;
 }
 
-// retrieves the inode number of a dinode structure
-uint geti(img_t img, inode_t ip) {
-    uint Ni = SBLK(img)->ninodes / IPB + 1;       // # of inode blocks
-    for (uint i = 0; i < Ni; i++) {
-        inode_t bp = (inode_t)img[SBLK(img)->inodestart + i];
-        if (bp <= ip && ip < bp + IPB)
-            return ip - bp + i * IPB;
-    }
-    derror("geti: %p: not in the inode blocks\n", ip);
-    return 0;
+// retrieves the inode number of a dinode structure
+uint geti(img_t img, inode_t ip) {
+    uint Ni = SBLK(img)->ninodes / img->ipb + 1;  // # of inode blocks
+    inode_t bp = (inode_t)BLK(img, SBLK(img)->inodestart);
+    if (bp <= ip && ip < bp + Ni * img->ipb)
+        return ip - bp;
+    derror("geti: %p: not in the inode blocks\n", ip);
+    return 0;
+}
+
+// the inode number of ip, or 0 if ip is NULL
+static uint geti0(img_t img, inode_t ip) {
+    return ip == NULL ? 0 : geti(img, ip);
+}
+
+// checks if the data of ip may be stored in the inode
+static inline bool can_inline(img_t img, inode_t ip) {
+    return (img->features & FS_INLINE) && ip->type == T_FILE;
+}
+
+// checks if the data of ip is stored in the inode
+bool is_inline(img_t img, inode_t ip) {
+    return can_inline(img, ip) && (ip->major & I_INLINE);
+}
+
+// allocate a new inode structure
+static inode_t do_ialloc(img_t img, uint type) {
+    // the search starts from the inode following the last one allocated
+    // so that creating many files is not quadratic
+    uint N = SBLK(img)->ninodes;
+    uint start = 1 <= img->ihint && img->ihint < N ? img->ihint : 1;
+    for (uint i = 0; i + 1 < N; i++) {
+        uint inum = start + i < N ? start + i : start + i - (N - 1);
+        inode_t ip = (inode_t)BLK(img, IBLK(img, inum)) + inum % img->ipb;
+        if (i == 0 || inum % img->ipb == 0)
+            BTRACE(img, IBLK(img, inum), 0);
+        if (ip->type == 0) {
+            BTRACE(img, IBLK(img, inum), BA_WRITE);
+            PERF_ADD(PC_INODE_PROBES, i + 1);
+            img->ihint = inum + 1;
+            memset(ip, 0, sizeof(struct dinode));
+            ip->type = type;
+            if (can_inline(img, ip))
+                ip->major = I_INLINE;
+            return ip;
+        }
+    }
+    PERF_ADD(PC_INODE_PROBES, N - 1);
+    fatal("ialloc: cannot allocate\n");
+    return NULL;
+}
+
+inode_t ialloc(img_t img, uint type) {
+    uint64 t0 = lat_start();
+    inode_t ip = do_ialloc(img, type);
+    lat_end(LAT_IALLOC, t0);
+    return ip;
+}
+
+// frees inum-th inode
+int ifree(img_t img, uint inum) {
+    inode_t ip = iget(img, inum);
+    if (ip == NULL)
+        return -1;
+    if (ip->type == 0)
+        dwarn("ifree: inode #%d is already freed\n", inum);
+    if (ip->nlink > 0)
+        dwarn("ifree: nlink of inode #%d is not zero\n", inum);
+    ip->type = 0;
+    BTRACE(img, IBLK(img, inum), BA_WRITE);
+    return 0;
+}
+
+// goal of the first block of the file specified by ip
+static inline uint bgoal(img_t img, inode_t ip) {
+    return img->bgoal_ip == ip ? img->bgoal : 0;
+}
+
+// allocates a block of the file specified by ip to follow its block prev
+// (if not 0)
+static uint balloc_file(img_t img, inode_t ip, uint prev) {
+    if (prev != 0)
+        return balloc_goal(img, prev + 1, true);
+    return balloc_goal(img, bgoal(img, ip), false);
+}
+
+// returns the block number stored in *slot of the file specified by ip,
+// allocating one to follow its block prev if it is empty
+static inline uint bslot(img_t img, inode_t ip, uint *slot, uint prev) {
+    if (*slot == 0) {
+        *slot = balloc_file(img, ip, prev);
+        if (slot >= ip->addrs && slot < ip->addrs + ALEN(ip->addrs))
+            idirty(img, ip);
+    }
+    return *slot;
+}
+
+// returns the pointer to the i-th extent of the file specified by ip, or
+// NULL if there is no room for it; the overflow extent block is allocated
+// if alloc is true
+struct extent *iextent(img_t img, inode_t ip, uint i, bool alloc) {
+    if (i < NEXTENT)
+        return (struct extent *)ip->addrs + i;
+    i -= NEXTENT;
+    if (i >= img->bsize / sizeof(struct extent))
+        return NULL;
+    if (ip->addrs[NDIRECT] == 0) {
+        if (!alloc)
+            return NULL;
+        ip->addrs[NDIRECT] = balloc(img);
+        idirty(img, ip);
+    }
+    BTRACE(img, ip->addrs[NDIRECT], BA_META);
+    return (struct extent *)BLK(img, ip->addrs[NDIRECT]) + i;
+}
+
+// returns n-th data block number of the extent-based file specified by
+// ip and, if run is not NULL, the number of blocks mapped contiguously
+// from there; blocks up to n are appended if necessary, extending the
+// last extent when the block following it is free
+static uint emap(img_t img, inode_t ip, uint n, uint *run) {
+    struct extent *e = NULL;
+    uint base = 0;  // file block number of the first block of e
+    uint i;
+    for (i = 0; (e = iextent(img, ip, i, false)) != NULL && e->len != 0; i++) {
+        if (n - base < e->len) {
+            if (run != NULL)
+                *run = e->len - (n - base);
+            return e->start + (n - base);
+        }
+        base += e->len;
+    }
+    uint b = 0;
+    for (; base <= n; base++) {
+        struct extent *last = i > 0 ? iextent(img, ip, i - 1, false) : NULL;
+        if (last != NULL && balloc_at(img, last->start + last->len)) {
+            b = last->start + last->len++;
+            if (i - 1 < NEXTENT)
+                idirty(img, ip);
+        }
+        else {
+            if ((e = iextent(img, ip, i, true)) == NULL) {
+                derror("bmap: %u: too many extents\n", n);
+                return 0;
+            }
+            e->start = b = balloc_file(img, ip, last != NULL ?
+                                       last->start + last->len - 1 : 0);
+            e->len = 1;
+            if (i < NEXTENT)
+                idirty(img, ip);
+            i++;
+        }
+    }
+    if (run != NULL)
+        *run = 1;
+    return b;
+}
+
+// frees the blocks of the extent-based file specified by ip except for
+// the first keep blocks
+static void etruncate(img_t img, inode_t ip, uint keep) {
+    struct extent *e;
+    uint base = 0;  // file block number of the first block of e
+    for (uint i = 0; (e = iextent(img, ip, i, false)) != NULL && e->len != 0;
+         i++) {
+        uint k = keep > base ? umin(keep - base, e->len) : 0;
+        for (uint j = k; j < e->len; j++)
+            bfree(img, e->start + j);
+        base += e->len;
+        e->len = k;
+        if (k == 0)
+            e->start = 0;
+    }
+    e = iextent(img, ip, NEXTENT, false);
+    if (e != NULL && e->len == 0) {
+        bfree(img, ip->addrs[NDIRECT]);
+        ip->addrs[NDIRECT] = 0;
+    }
+}
+
+// returns n-th data block number of the file specified by ip; the
+// lookups through indirect blocks are counted if count is true
+static uint do_bmap(img_t img, inode_t ip, uint n, bool count) {
+    if (img->features & FS_EXTENTS)
+        return emap(img, ip, n, NULL);
+    const uint NI = img->nindirect;
+    // each block is allocated to follow the block preceding it in the
+    // file (or the indirect block referring to it)
+    uint k = n;
+    if (k < img->ndirect)
+        return bslot(img, ip, &ip->addrs[k], k > 0 ? ip->addrs[k - 1] : 0);
+    k -= img->ndirect;
+    if (count)
+        PERF_ADD(PC_INDIRECT, 1);
+    if (k < NI) {
+        uint iaddr = bslot(img, ip, &ip->addrs[img->ndirect],
+                           ip->addrs[img->ndirect - 1]);
+        BTRACE(img, iaddr, BA_META);
+        uint *iblock = (uint *)BLK(img, iaddr);
+        return bslot(img, ip, &iblock[k],
+                     k > 0 && iblock[k - 1] != 0 ? iblock[k - 1] : iaddr);
+    }
+    k -= NI;
+    if ((img->features & FS_DINDIRECT) && k / NI < NI) {
+        // the singly-indirect block last looked up is remembered, so that
+        // sequential accesses do not walk the double-indirect block again
+        uint i1 = k / NI;
+        uint iaddr;
+        if (img->bcache_ip == ip && img->bcache_i1 == i1) {
+            if (count)
+                PERF_ADD(PC_INDIRECT_HITS, 1);
+            iaddr = img->bcache_addr;
+        }
+        else {
+            uint daddr = bslot(img, ip, &ip->addrs[img->ndirect + 1], 0);
+            BTRACE(img, daddr, BA_META);
+            uint *dblock = (uint *)BLK(img, daddr);
+            iaddr = bslot(img, ip, &dblock[i1], daddr);
+            img->bcache_ip = ip;
+            img->bcache_i1 = i1;
+            img->bcache_addr = iaddr;
+        }
+        BTRACE(img, iaddr, BA_META);
+        uint *iblock = (uint *)BLK(img, iaddr);
+        k %= NI;
+        return bslot(img, ip, &iblock[k],
+                     k > 0 && iblock[k - 1] != 0 ? iblock[k - 1] : iaddr);
+    }
+    derror("bmap: %u: invalid index number\n", n);
+    return 0;
+}
+
+uint bmap(img_t img, inode_t ip, uint n) {
+    PERF_ADD(PC_BMAP, 1);
+    return do_bmap(img, ip, n, true);
+}
+
+// number of data blocks covered by an entry of an indirect block of level
+// (1: singly indirect, 2: doubly indirect)
+static inline uint ispan(img_t img, uint level) {
+    return level == 1 ? 1 : img->nindirect;
+}
+
+// counts the blocks (including indirect blocks) missing to map the first
+// n data blocks below addr, which is a block of level (0: data block)
+static uint bmissing(img_t img, uint addr, uint n, uint level) {
+    if (n == 0)
+        return 0;
+    if (level == 0)
+        return addr == 0;
+    uint *iblock = addr != 0 ? (uint *)BLK(img, addr) : NULL;
+    uint span = ispan(img, level);
+    uint c = addr == 0;
+    for (uint i = 0; i * span < n; i++)
+        c += bmissing(img, iblock != NULL ? iblock[i] : 0,
+                      umin(n - i * span, span), level - 1);
+    return c;
+}
+
+// frees the blocks below *slot, which refers to a block of level
+// (0: data block), except for the first keep data blocks; the block
+// itself is freed if keep is 0
+static void bfree_tree(img_t img, uint *slot, uint keep, uint level) {
+    if (*slot == 0)
+        return;
+    if (level > 0) {
+        uint *iblock = (uint *)BLK(img, *slot);
+        uint span = ispan(img, level);
+        for (uint i = keep / span; i < img->nindirect; i++)
+            bfree_tree(img, &iblock[i], keep > i * span ? keep - i * span : 0,
+                       level - 1);
+    }
+    if (keep == 0) {
+        bfree(img, *slot);
+        *slot = 0;
+    }
+}
+
+// calls f on each block below addr, which is a block of level, in file
+// order (an indirect block precedes the blocks it refers to)
+static int bwalk(img_t img, uint addr, uint level,
+                 int (*f)(img_t, uint, void *), void *arg) {
+    if (addr == 0)
+        return 0;
+    int r = f(img, addr, arg);
+    if (r != 0 || level == 0)
+        return r;
+    uint *iblock = (uint *)BLK(img, addr);
+    for (uint i = 0; i < img->nindirect && r == 0; i++)
+        r = bwalk(img, iblock[i], level - 1, f, arg);
+    return r;
 }
 
-// allocate a new inode structure
-inode_t ialloc(img_t img, uint type) {
-    for (uint inum = 1; inum < SBLK(img)->ninodes; inum++) {
-        inode_t ip = (inode_t)img[IBLOCK(inum, SBLKS(img))] + inum % IPB;
-        if (ip->type == 0) {
-            memset(ip, 0, sizeof(struct dinode));
-            ip->type = type;
-            return ip;
+// calls f on each block (data and indirect blocks) allocated to the file
+// specified by ip until f returns nonzero, which is returned
+int iblocks(img_t img, inode_t ip, int (*f)(img_t, uint, void *), void *arg) {
+    int r = 0;
+    if (is_inline(img, ip))
+        return 0;
+    if (img->features & FS_EXTENTS) {
+        struct extent *e;
+        for (uint i = 0; r == 0 && (e = iextent(img, ip, i, false)) != NULL &&
+                 e->len != 0; i++) {
+            if (i == NEXTENT)
+                r = f(img, ip->addrs[NDIRECT], arg);
+            for (uint j = 0; j < e->len && r == 0; j++)
+                r = f(img, e->start + j, arg);
         }
+        return r;
     }
-    fatal("ialloc: cannot allocate\n");
-    return NULL;
+    for (uint i = 0; i < img->ndirect && r == 0; i++)
+        r = bwalk(img, ip->addrs[i], 0, f, arg);
+    if (r == 0)
+        r = bwalk(img, ip->addrs[img->ndirect], 1, f, arg);
+    if (r == 0 && (img->features & FS_DINDIRECT))
+        r = bwalk(img, ip->addrs[img->ndirect + 1], 2, f, arg);
+    return r;
 }
 
-// frees inum-th inode
-int ifree(img_t img, uint inum) {
-    inode_t ip = iget(img, inum);
-    if (ip == NULL)
-        return -1;
-    if (ip->type == 0)
-        dwarn("ifree: inode #%d is already freed\n", inum);
-    if (ip->nlink > 0)
-        dwarn("ifree: nlink of inode #%d is not zero\n", inum);
-    ip->type = 0;
-    return 0;
+// moves the data of ip stored in the inode to a data block
+static int iuninline(img_t img, inode_t ip) {
+    uchar buf[INLINESIZE];
+    uint size = ip->size;
+    memmove(buf, ip->addrs, size);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->major &= ~I_INLINE;
+    ip->size = 0;
+    idirty(img, ip);
+    return iwrite(img, ip, buf, size, 0) == (int)size ? 0 : -1;
 }
 
-// returns n-th data block number of the file specified by ip
-uint bmap(img_t img, inode_t ip, uint n) {
-    if (n < NDIRECT) {
-        uint addr = ip->addrs[n];
-        if (addr == 0) {
-            addr = balloc(img);
-            ip->addrs[n] = addr;
-        }
-        return addr;
+// preallocates data blocks (and indirect blocks if needed) to cover
+// the first size bytes of the file specified by ip without changing its
+// size; the missing blocks are taken from a single contiguous run if
+// possible
+int iprealloc(img_t img, inode_t ip, uint size) {
+    if (ip->type == T_DEV)
+        return -1;
+    if (size > img->maxfilesize)
+        return -1;
+    if (is_inline(img, ip)) {
+        if (size <= INLINESIZE)
+            return 0;
+        if (iuninline(img, ip) < 0)
+            return -1;
+    }
+
+    const uint NI = img->nindirect;
+    uint n = divceil(size, img->bsize);  // # of blocks to be reserved
+    uint need = 0;                       // # of blocks missing
+    if (img->features & FS_EXTENTS) {
+        struct extent *e;
+        need = n;
+        for (uint i = 0; need > 0 && (e = iextent(img, ip, i, false)) != NULL
+                 && e->len != 0; i++)
+            need -= umin(need, e->len);
     }
     else {
-        uint k = n - NDIRECT;
-        if (k >= NINDIRECT) {
-            derror("bmap: %u: invalid index number\n", n);
-            return 0;
-        }
-        uint iaddr = ip->addrs[NDIRECT];
-        if (iaddr == 0) {
-            iaddr = balloc(img);
-            ip->addrs[NDIRECT] = iaddr;
-        }
-        uint *iblock = (uint *)img[iaddr];
-        if (iblock[k] == 0)
-            iblock[k] = balloc(img);
-        return iblock[k];
+        for (uint i = 0; i < n && i < img->ndirect; i++)
+            need += ip->addrs[i] == 0;
+        if (n > img->ndirect)
+            need += bmissing(img, ip->addrs[img->ndirect],
+                             umin(n - img->ndirect, NI), 1);
+        if (n > img->ndirect + NI)
+            need += bmissing(img, ip->addrs[img->ndirect + 1],
+                             n - img->ndirect - NI, 2);
     }
+    if (need == 0)
+        return 0;
+
+    // bmap allocates the blocks in file order (an indirect block just
+    // before the first block it refers to), so with the hint pointing to
+    // the run they are laid out contiguously
+    img->bhint = bfind(img, need, bgoal(img, ip));
+    int r = 0;
+    for (uint i = 0; i < n && r == 0; i++)
+        if (bmap(img, ip, i) == 0)
+            r = -1;
+    img->bhint = 0;
+    return r;
 }
 
 // reads n byte of data from the file specified by ip
-int iread(img_t img, inode_t ip, uchar *buf, uint n, uint off) {
+static int do_iread(img_t img, inode_t ip, uchar *buf, uint n, uint off) {
+    PERF_ADD(PC_IREAD, 1);
     if (ip->type == T_DEV)
         return -1;
+    // the count is returned as an int
+    if (n > INT_MAX)
+        n = INT_MAX;
     if (off > ip->size || off + n < off)
         return -1;
     if (off + n > ip->size)
         n = ip->size - off;
+    if (is_inline(img, ip)) {
+        memmove(buf, (uchar *)ip->addrs + off, n);
+        PERF_ADD(PC_BYTES_COPIED, n);
+        return n;
+    }
     // t : total bytes that have been read
     // m : last bytes that were read
     uint t = 0;
     for (uint m = 0; t < n; t += m, off += m, buf += m) {
-        uint b = bmap(img, ip, off / BSIZE);
-        if (!valid_data_block(img, b)) {
+        // an extent is read by a single memmove
+        uint run = 1;
+        uint b;
+        if (img->features & FS_EXTENTS) {
+            PERF_ADD(PC_BMAP, 1);
+            b = emap(img, ip, off >> img->bshift, &run);
+        }
+        else
+            b = bmap(img, ip, off >> img->bshift);
+        if (!valid_data_block(img, b) || !valid_data_block(img, b + run - 1)) {
             derror("iread: %u: invalid data block\n", b);
             break;
         }
-        m = min(n - t, BSIZE - off % BSIZE);
-        memmove(buf, img[b] + off % BSIZE, m);
+        uint boff = off & (img->bsize - 1);
+        uint64 avail = ((uint64)run << img->bshift) - boff;
+        m = n - t < avail ? n - t : avail;
+        if (blktrace_file != NULL) {
+            uint64 nb = ((uint64)boff + m + img->bsize - 1) >> img->bshift;
+            for (uint j = 0; j < nb; j++)
+                blktrace(img, b + j, ip->type == T_DIR ? BA_META : 0);
+        }
+        memmove(buf, BLK(img, b) + boff, m);
     }
+    PERF_ADD(PC_BYTES_COPIED, t);
     return t;
 }
 
+int iread(img_t img, inode_t ip, uchar *buf, uint n, uint off) {
+    uint64 t0 = lat_start();
+    trace_depth++;
+    int r = do_iread(img, ip, buf, n, off);
+    lat_end(LAT_IREAD, t0);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_READ, geti(img, ip), NULL, off, n, r);
+    return r;
+}
+
 // writes n byte of data to the file specified by ip
-int iwrite(img_t img, inode_t ip, uchar *buf, uint n, uint off) {
+static int do_iwrite(img_t img, inode_t ip, uchar *buf, uint n, uint off) {
+    PERF_ADD(PC_IWRITE, 1);
     if (ip->type == T_DEV)
         return -1;
-    if (off > ip->size || off + n < off || off + n > MAXFILESIZE)
+    // the count is returned as an int
+    if (n > INT_MAX)
+        n = INT_MAX;
+    if (off > ip->size || off + n < off || off + n > img->maxfilesize)
         return -1;
+    if (is_inline(img, ip)) {
+        if (off + n <= INLINESIZE) {
+            memmove((uchar *)ip->addrs + off, buf, n);
+            if (off + n > ip->size)
+                ip->size = off + n;
+            if (n > 0)
+                idirty(img, ip);
+            PERF_ADD(PC_BYTES_COPIED, n);
+            return n;
+        }
+        // the file outgrows the inode
+        if (iuninline(img, ip) < 0)
+            return -1;
+    }
     // t : total bytes that have been written
     // m : last bytes that were written
     uint t = 0;
     for (uint m = 0; t < n; t += m, off += m, buf += m) {
-        uint b = bmap(img, ip, off / BSIZE);
+        uint b = bmap(img, ip, off >> img->bshift);
         if (!valid_data_block(img, b)) {
             derror("iwrite: %u: invalid data block\n", b);
             break;
         }
-        m = min(n - t, BSIZE - off % BSIZE);
-        memmove(img[b] + off % BSIZE, buf, m);
+        uint boff = off & (img->bsize - 1);
+        m = umin(n - t, img->bsize - boff);
+        BTRACE(img, b, BA_WRITE | (ip->type == T_DIR ? BA_META : 0));
+        memmove(BLK(img, b) + boff, buf, m);
     }
-    if (t > 0 && off > ip->size)
+    if (t > 0 && off > ip->size) {
         ip->size = off;
+        idirty(img, ip);
+    }
+    PERF_ADD(PC_BYTES_COPIED, t);
     return t;
 }
 
+int iwrite(img_t img, inode_t ip, uchar *buf, uint n, uint off) {
+    uint64 t0 = lat_start();
+    trace_depth++;
+    int r = do_iwrite(img, ip, buf, n, off);
+    lat_end(LAT_IWRITE, t0);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_WRITE, geti(img, ip), NULL, off, n, r);
+    idirty_flush(img);
+    return r;
+}
+
+// frees the data blocks of the file specified by ip except for the first
+// k blocks
+static void ibfree(img_t img, inode_t ip, uint k) {
+    const uint ND = img->ndirect;
+    const uint NI = img->nindirect;
+    if (img->features & FS_EXTENTS) {
+        etruncate(img, ip, k);
+        return;
+    }
+    for (uint i = k; i < ND; i++)
+        bfree_tree(img, &ip->addrs[i], 0, 0);
+    bfree_tree(img, &ip->addrs[ND], k > ND ? k - ND : 0, 1);
+    if (img->features & FS_DINDIRECT)
+        bfree_tree(img, &ip->addrs[ND + 1], k > ND + NI ? k - ND - NI : 0, 2);
+}
+
 // truncate the file specified by ip to size
-int itruncate(img_t img, inode_t ip, uint size) {
+static int do_itruncate(img_t img, inode_t ip, uint size) {
     if (ip->type == T_DEV)
         return -1;
-    if (size > MAXFILESIZE)
+    if (size > img->maxfilesize)
         return -1;
 
-    if (size < ip->size) {
-        int n = divceil(ip->size, BSIZE);  // # of used blocks
-        int k = divceil(size, BSIZE);      // # of blocks to keep
-        int nd = min(n, NDIRECT);          // # of used direct blocks
-        int kd = min(k, NDIRECT);          // # of direct blocks to keep
-        for (int i = kd; i < nd; i++) {
-            bfree(img, ip->addrs[i]);
-            ip->addrs[i] = 0;
+    img->bcache_ip = NULL;
+    if (is_inline(img, ip)) {
+        uchar *data = (uchar *)ip->addrs;
+        if (size <= INLINESIZE) {
+            // the unused part of the inode is kept zero
+            if (size > ip->size)
+                memset(data + ip->size, 0, size - ip->size);
+            else
+                memset(data + size, 0, INLINESIZE - size);
+            ip->size = size;
+            idirty(img, ip);
+            return 0;
         }
+        if (iuninline(img, ip) < 0)
+            return -1;
+    }
+    else if (can_inline(img, ip) && size <= INLINESIZE && size <= ip->size) {
+        // a file shrinking enough is moved into the inode
+        uchar buf[INLINESIZE];
+        if (iread(img, ip, buf, size, 0) != (int)size)
+            return -1;
+        ibfree(img, ip, 0);
+        memset(ip->addrs, 0, sizeof(ip->addrs));
+        memmove(ip->addrs, buf, size);
+        ip->major |= I_INLINE;
+        ip->size = size;
+        idirty(img, ip);
+        return 0;
+    }
 
-        if (n > NDIRECT) {
-            uint iaddr = ip->addrs[NDIRECT];
-            assert(iaddr != 0);
-            uint *iblock = (uint *)img[iaddr];
-            int ni = max(n - NDIRECT, 0);  // # of used indirect blocks
-            int ki = max(k - NDIRECT, 0);  // # of indirect blocks to keep
-            for (int i = ki; i < ni; i++) {
-                bfree(img, iblock[i]);
-                iblock[i] = 0;
-            }
-            if (ki == 0) {
-                bfree(img, iaddr);
-                ip->addrs[NDIRECT] = 0;
-            }
-        }
+    if (size <= ip->size) {
+        // blocks beyond the end of the file may have been preallocated,
+        // so every allocated block from k on is released
+        ibfree(img, ip, divceil(size, img->bsize));
     }
     else {
         uint n = size - ip->size; // # of bytes to be filled
         for (uint off = ip->size, t = 0, m = 0; t < n; t += m, off += m) {
-            uchar *bp = img[bmap(img, ip, off / BSIZE)];
-            m = min(n - t, BSIZE - off % BSIZE);
-            memset(bp + off % BSIZE, 0, m);
+            uint b = bmap(img, ip, off >> img->bshift);
+            if (!valid_data_block(img, b)) {
+                derror("itruncate: %u: invalid data block\n", b);
+                ip->size = off;
+                idirty(img, ip);
+                return -1;
+            }
+            BTRACE(img, b, BA_WRITE | (ip->type == T_DIR ? BA_META : 0));
+            uchar *bp = BLK(img, b);
+            uint boff = off & (img->bsize - 1);
+            m = umin(n - t, img->bsize - boff);
+            memset(bp + boff, 0, m);
         }
     }
     ip->size = size;
+    idirty(img, ip);
     return 0;
 }
 
+int itruncate(img_t img, inode_t ip, uint size) {
+    uint64 t0 = lat_start();
+    trace_depth++;
+    int r = do_itruncate(img, ip, size);
+    lat_end(LAT_ITRUNCATE, t0);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_TRUNCATE, geti(img, ip), NULL, 0, size, r);
+    idirty_flush(img);
+    return r;
+}
+
 
 /*
  * Pathname handling functions
@@ -431,52 +1888,609 @@ char *splitpath(char *path, char *dirbuf, uint size) {
  * Operations on directories
  */
 
-// search a file (name) in a directory (dp)
-inode_t dlookup(img_t img, inode_t dp, char *name, uint *offp) {
-    assert(dp->type == T_DIR);
-    struct dirent de;
-    for (uint off = 0; off < dp->size; off += sizeof(de)) {
-        if (iread(img, dp, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
-            derror("dlookup: %s: read error\n", name);
-            return NULL;
+// decodes the directory entry at p
+void dload(img_t img, struct dentry *de, const uchar *p) {
+    memset(de->name, 0, DIRSIZ);
+    if (img->features & FS_WIDEINUM) {
+        const struct wdirent *w = (const struct wdirent *)p;
+        de->inum = w->inum;
+        memmove(de->name, w->name, WDIRSIZ);
+    }
+    else {
+        const struct dirent *d = (const struct dirent *)p;
+        de->inum = d->inum;
+        memmove(de->name, d->name, DIRSIZ);
+    }
+}
+
+// encodes de into the directory entry at p
+void dstore(img_t img, uchar *p, const struct dentry *de) {
+    if (img->features & FS_WIDEINUM) {
+        struct wdirent *w = (struct wdirent *)p;
+        w->inum = de->inum;
+        memmove(w->name, de->name, WDIRSIZ);
+    }
+    else {
+        struct dirent *d = (struct dirent *)p;
+        d->inum = de->inum;
+        memmove(d->name, de->name, DIRSIZ);
+    }
+}
+
+// reads the directory entry at off in dp
+int dread(img_t img, inode_t dp, struct dentry *de, uint off) {
+    uchar buf[sizeof(struct dirent)];
+    if (iread(img, dp, buf, sizeof(buf), off) != sizeof(buf))
+        return -1;
+    dload(img, de, buf);
+    return 0;
+}
+
+// writes the directory entry at off in dp
+int dwrite(img_t img, inode_t dp, const struct dentry *de, uint off) {
+    uchar buf[sizeof(struct dirent)];
+    dstore(img, buf, de);
+    if (iwrite(img, dp, buf, sizeof(buf), off) != sizeof(buf))
+        return -1;
+    return 0;
+}
+
+// makes a directory entry (name, inum)
+static struct dentry dentry(img_t img, char *name, uint inum) {
+    struct dentry de;
+    de.inum = inum;
+    memset(de.name, 0, DIRSIZ);
+    strncpy(de.name, name, img->dirsiz);
+    return de;
+}
+
+// compares the names of directory entries
+static inline int dnamecmp(img_t img, const char *s, const char *t) {
+    PERF_ADD(PC_DIRENT_CMPS, 1);
+    return strncmp(s, t, img->dirsiz);
+}
+
+// hash value of a file name (FNV-1a)
+static uint dxhash(img_t img, char *name) {
+    uint h = 2166136261U;
+    for (uint i = 0; i < img->dirsiz && name[i] != 0; i++) {
+        h ^= (uchar)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// checks if dp is an indexed directory
+bool is_indexed(inode_t dp) {
+    return dp->type == T_DIR && (dp->major & I_INDEX);
+}
+
+// returns the address of the lb-th block of the directory dp, or NULL if
+// there is no such block
+static uchar *dblock(img_t img, inode_t dp, uint lb) {
+    if (lb >= dp->size / img->bsize)
+        return NULL;
+    uint b = bmap(img, dp, lb);
+    if (!valid_data_block(img, b))
+        return NULL;
+    BTRACE(img, b, BA_META);
+    return BLK(img, b);
+}
+
+// appends a zero-filled block to the directory dp and returns its
+// address, or NULL if dp cannot grow
+static uchar *dgrow(img_t img, inode_t dp) {
+    uint lb = divceil(dp->size, img->bsize);
+    if (lb >= img->maxfile)
+        return NULL;
+    uint b = bmap(img, dp, lb);
+    if (!valid_data_block(img, b))
+        return NULL;
+    BTRACE(img, b, BA_WRITE | BA_META);
+    memset(BLK(img, b), 0, img->bsize);
+    dp->size = (lb + 1) * img->bsize;
+    idirty(img, dp);
+    return BLK(img, b);
+}
+
+// maximum # of index entries in the root (lb = 0) or a node
+static inline uint dxlimit(img_t img, uint lb) {
+    return img->bsize / sizeof(struct dxentry) - (lb == 0 ? 3 : 1);
+}
+
+// returns the header of the index block lb of dp, or NULL if it is broken
+static struct dxhead *dxhead(img_t img, inode_t dp, uint lb) {
+    uchar *bp = dblock(img, dp, lb);
+    if (bp == NULL)
+        return NULL;
+    struct dxhead *h =
+        (struct dxhead *)(lb == 0 ? bp + 2 * sizeof(struct dirent) : bp);
+    if (h->zero != 0 || h->magic != DXMAGIC || h->count == 0 ||
+        h->count > dxlimit(img, lb) || h->levels > (lb == 0 ? 1 : 0))
+        return NULL;
+    return h;
+}
+
+// returns the last entry of the index block h whose hash is not greater
+// than hash (the hash of the first entry is always 0)
+static struct dxentry *dxsearch(struct dxhead *h, uint hash) {
+    struct dxentry *e = (struct dxentry *)(h + 1);
+    uint lo = 0, hi = h->count;
+    while (hi - lo > 1) {
+        uint mid = (lo + hi) / 2;
+        if (e[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &e[lo];
+}
+
+// inserts an index entry (hash, lb) just after e in the index block h
+static void dxinsert(struct dxhead *h, struct dxentry *e, uint hash, uint lb) {
+    struct dxentry *end = (struct dxentry *)(h + 1) + h->count;
+    memmove(e + 2, e + 1, (end - (e + 1)) * sizeof(*e));
+    e[1] = (struct dxentry){ 0, hash, lb, 0 };
+    h->count++;
+}
+
+// path from the root of an index to a leaf
+struct dxpath {
+    struct dxhead *h[2];   // root and node (if the root has a level below)
+    struct dxentry *e[2];  // entries followed in them
+    uint leaf;             // block number of the leaf within the directory
+};
+
+// finds the leaf of dp for hash; returns -1 if the index is broken
+static int dxfind(img_t img, inode_t dp, uint hash, struct dxpath *p) {
+    if ((p->h[0] = dxhead(img, dp, 0)) == NULL)
+        return -1;
+    p->e[0] = dxsearch(p->h[0], hash);
+    uint lb = p->e[0]->block;
+    if (p->h[0]->levels == 1) {
+        if (lb == 0 || (p->h[1] = dxhead(img, dp, lb)) == NULL)
+            return -1;
+        p->e[1] = dxsearch(p->h[1], hash);
+        lb = p->e[1]->block;
+    }
+    if (lb == 0 || dblock(img, dp, lb) == NULL)
+        return -1;
+    p->leaf = lb;
+    return 0;
+}
+
+// makes room for a new entry in the index block above the leaf of p;
+// returns -1 if the index cannot grow
+static int dxgrow(img_t img, inode_t dp, struct dxpath *p) {
+    struct dxhead *root = p->h[0];
+    if (root->levels == 0) {
+        // move all the root entries to a new node
+        struct dxhead *node = (struct dxhead *)dgrow(img, dp);
+        if (node == NULL)
+            return -1;
+        *node = (struct dxhead){ 0, DXMAGIC, 0, root->count, 0 };
+        memmove(node + 1, root + 1, root->count * sizeof(struct dxentry));
+        root->levels = 1;
+        root->count = 1;
+        *(struct dxentry *)(root + 1) =
+            (struct dxentry){ 0, 0, dp->size / img->bsize - 1, 0 };
+        return 0;
+    }
+    // split the node into two
+    if (root->count >= dxlimit(img, 0))
+        return -1;
+    struct dxhead *node = p->h[1];
+    struct dxhead *new = (struct dxhead *)dgrow(img, dp);
+    if (new == NULL)
+        return -1;
+    struct dxentry *e = (struct dxentry *)(node + 1);
+    uint half = node->count / 2;
+    *new = (struct dxhead){ 0, DXMAGIC, 0, node->count - half, 0 };
+    memmove(new + 1, e + half, (node->count - half) * sizeof(*e));
+    node->count = half;
+    dxinsert(root, p->e[0], e[half].hash, dp->size / img->bsize - 1);
+    return 0;
+}
+
+// directory entry with its name hash (used to split leaves)
+struct dxsort {
+    uint hash;
+    struct dentry de;
+};
+
+static int dxcmp(const void *x, const void *y) {
+    uint a = ((struct dxsort *)x)->hash, b = ((struct dxsort *)y)->hash;
+    return a < b ? -1 : a > b;
+}
+
+// splits the full leaf of p at a hash boundary; returns -1 on failure
+static int dxsplit(img_t img, inode_t dp, struct dxpath *p) {
+    const uint DPB = img->bsize / sizeof(struct dirent);
+    uchar *bp = dblock(img, dp, p->leaf);
+    struct dxsort *s = malloc(DPB * sizeof(*s));
+    if (s == NULL)
+        return -1;
+    uint n = 0;
+    for (uint i = 0; i < DPB; i++) {
+        dload(img, &s[n].de, bp + i * sizeof(struct dirent));
+        if (s[n].de.inum != 0) {
+            s[n].hash = dxhash(img, s[n].de.name);
+            n++;
         }
-        if (strncmp(name, de.name, DIRSIZ) == 0) {
-            if (offp != NULL)
-                *offp = off;
-            return iget(img, de.inum);
+    }
+    qsort(s, n, sizeof(*s), dxcmp);
+    // entries with the same hash must stay in the same leaf
+    uint k;
+    for (k = n / 2; k < n && s[k].hash == s[k - 1].hash; k++)
+        ;
+    if (k == n)
+        for (k = n / 2; k > 0 && s[k].hash == s[k - 1].hash; k--)
+            ;
+    uchar *nbp;
+    if (k == 0 || (nbp = dgrow(img, dp)) == NULL) {
+        free(s);
+        return -1;
+    }
+    memset(bp, 0, img->bsize);
+    for (uint i = 0; i < k; i++)
+        dstore(img, bp + i * sizeof(struct dirent), &s[i].de);
+    for (uint i = k; i < n; i++)
+        dstore(img, nbp + (i - k) * sizeof(struct dirent), &s[i].de);
+    uint l = p->h[0]->levels;
+    dxinsert(p->h[l], p->e[l], s[k].hash, dp->size / img->bsize - 1);
+    free(s);
+    return 0;
+}
+
+// adds an entry (name, inum) to the indexed directory dp; returns 0 on
+// success, -1 on error, or 1 if the index is broken or cannot grow
+static int dxadd(img_t img, inode_t dp, char *name, uint inum) {
+    const uint DPB = img->bsize / sizeof(struct dirent);
+    uint hash = dxhash(img, name);
+    struct dxpath p;
+    while (true) {
+        if (dxfind(img, dp, hash, &p) < 0)
+            return 1;
+        uchar *bp = dblock(img, dp, p.leaf);
+        uchar *fp = NULL;  // first free entry
+        for (uint i = 0; i < DPB; i++) {
+            struct dentry de;
+            dload(img, &de, bp + i * sizeof(struct dirent));
+            if (de.inum == 0) {
+                if (fp == NULL)
+                    fp = bp + i * sizeof(struct dirent);
+            }
+            else if (dnamecmp(img, de.name, name) == 0) {
+                derror("daddent: %s: exists\n", name);
+                return -1;
+            }
+        }
+        if (fp != NULL) {
+            struct dentry de = dentry(img, name, inum);
+            dstore(img, fp, &de);
+            return 0;
+        }
+        uint l = p.h[0]->levels;
+        if (p.h[l]->count >= dxlimit(img, l)) {
+            if (dxgrow(img, dp, &p) < 0)
+                return 1;
         }
+        else if (dxsplit(img, dp, &p) < 0)
+            return 1;
     }
-    return NULL;
 }
 
-// add a new directory entry in dp
-int daddent(img_t img, inode_t dp, char *name, inode_t ip) {
-    struct dirent de;
+// looks up name in the indexed directory dp; returns -1 if the index is
+// broken
+static int dxlookup(img_t img, inode_t dp, char *name, uint *inump,
+                    uint *offp) {
+    const uint DPB = img->bsize / sizeof(struct dirent);
+    struct dxpath p;
+    if (dxfind(img, dp, dxhash(img, name), &p) < 0)
+        return -1;
+    uchar *bp = dblock(img, dp, p.leaf);
+    *inump = 0;
+    for (uint i = 0; i < DPB; i++) {
+        struct dentry de;
+        dload(img, &de, bp + i * sizeof(struct dirent));
+        if (de.inum != 0 && dnamecmp(img, name, de.name) == 0) {
+            *inump = de.inum;
+            *offp = p.leaf * img->bsize + i * sizeof(struct dirent);
+            break;
+        }
+    }
+    return 0;
+}
+
+// adds an entry (name, inum) to the directory dp by linear search
+static int dladd(img_t img, inode_t dp, char *name, uint inum) {
+    struct dentry de;
     uint off;
     // try to find an empty entry
-    for (off = 0; off < dp->size; off += sizeof(de)) {
-        if (iread(img, dp, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
+    for (off = 0; off < dp->size; off += sizeof(struct dirent)) {
+        if (dread(img, dp, &de, off) < 0) {
             derror("daddent: %u: read error\n", geti(img, dp));
             return -1;
         }
         if (de.inum == 0)
             break;
-        if (strncmp(de.name, name, DIRSIZ) == 0) {
+        if (dnamecmp(img, de.name, name) == 0) {
             derror("daddent: %s: exists\n", name);
             return -1;
         }
     }
-    strncpy(de.name, name, DIRSIZ);
-    de.inum = geti(img, ip);
-    if (iwrite(img, dp, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
+    de = dentry(img, name, inum);
+    if (dwrite(img, dp, &de, off) < 0) {
         derror("daddent: %u: write error\n", geti(img, dp));
         return -1;
     }
-    if (strncmp(name, ".", DIRSIZ) != 0)
+    return 0;
+}
+
+// reads the entries of the directory dp other than "." and ".." into a
+// newly allocated array; returns NULL on error
+static struct dentry *dentries(img_t img, inode_t dp, uint *np,
+                               uint *dotp, uint *dotdotp) {
+    uint nent = dp->size / sizeof(struct dirent) + 2;
+    struct dentry *ents = malloc(nent * sizeof(struct dentry));
+    if (ents == NULL)
+        return NULL;
+    uint n = 0, dot = 0, dotdot = 0;
+    struct dentry de;
+    for (uint off = 0; off < dp->size; off += sizeof(struct dirent)) {
+        if (dread(img, dp, &de, off) < 0) {
+            derror("dentries: %u: read error\n", geti(img, dp));
+            free(ents);
+            return NULL;
+        }
+        if (de.inum == 0)
+            continue;
+        if (strncmp(de.name, ".", DIRSIZ) == 0)
+            dot = de.inum;
+        else if (strncmp(de.name, "..", DIRSIZ) == 0)
+            dotdot = de.inum;
+        else
+            ents[n++] = de;
+    }
+    if (dot == 0 || dotdot == 0) {
+        derror("dentries: %u: no \".\" or \"..\"\n", geti(img, dp));
+        free(ents);
+        return NULL;
+    }
+    *np = n;
+    *dotp = dot;
+    *dotdotp = dotdot;
+    return ents;
+}
+
+// builds the indexed form of a directory with the entries ents[0..n-1]
+// besides "." and ".." in the empty directory dp; returns the number of
+// entries that could not be added, or -1 if dp cannot grow
+static int dxbuild(img_t img, inode_t dp, struct dentry *ents, uint n,
+                   uint dot, uint dotdot) {
+    // block 0 holds ".", ".." and the root index referring to an empty
+    // leaf (block 1)
+    uchar *bp = dgrow(img, dp);
+    if (bp == NULL || dgrow(img, dp) == NULL)
+        return -1;
+    struct dentry de = dentry(img, ".", dot);
+    dstore(img, bp, &de);
+    de = dentry(img, "..", dotdot);
+    dstore(img, bp + sizeof(struct dirent), &de);
+    struct dxhead *root = (struct dxhead *)(bp + 2 * sizeof(struct dirent));
+    *root = (struct dxhead){ 0, DXMAGIC, 0, 1, 0 };
+    *(struct dxentry *)(root + 1) = (struct dxentry){ 0, 0, 1, 0 };
+    dp->major |= I_INDEX;
+    idirty(img, dp);
+
+    int nerr = 0;
+    for (uint i = 0; i < n; i++) {
+        int r = 1;
+        if (is_indexed(dp) &&
+            (r = dxadd(img, dp, ents[i].name, ents[i].inum)) == 0)
+            continue;
+        if (r > 0) {
+            // the remaining entries are stored without the index
+            dp->major &= ~I_INDEX;
+            idirty(img, dp);
+            r = dladd(img, dp, ents[i].name, ents[i].inum);
+        }
+        if (r < 0)
+            nerr++;
+    }
+    return nerr;
+}
+
+// converts the directory dp into an indexed directory.  The new form is
+// built in a scratch inode and takes the place of the blocks of dp only
+// when every entry has been added, so that dp is left as it was if the
+// image is full.  Returns 0 on success, the number of entries that could
+// not be added, or -1 on other errors.
+int dindex(img_t img, inode_t dp) {
+    if (dp->type != T_DIR)
+        return -1;
+    if (is_indexed(dp))
+        return 0;
+    uint n, dot, dotdot;
+    struct dentry *ents = dentries(img, dp, &n, &dot, &dotdot);
+    if (ents == NULL)
+        return -1;
+
+    // balloc and ialloc call fatal() when they run out of space, which
+    // comes back here to release the scratch inode
+    jmp_buf saved;
+    memcpy(saved, fatal_exception_buf, sizeof(jmp_buf));
+    uint depth = trace_depth, ndirty = nidirty;
+    inode_t volatile sp = NULL;
+    int r;
+    trace_depth++;
+    if (setjmp(fatal_exception_buf) == 0) {
+        sp = do_ialloc(img, T_DIR);
+        r = dxbuild(img, sp, ents, n, dot, dotdot);
+    }
+    else {
+        trace_depth = depth + 1;
+        nidirty = ndirty;
+        r = -1;
+    }
+    memcpy(fatal_exception_buf, saved, sizeof(jmp_buf));
+    free(ents);
+    if (r != 0)
+        derror("dindex: %u: cannot index\n", geti(img, dp));
+
+    if (sp != NULL) {
+        if (r == 0) {
+            // dp takes the blocks of sp, whose old ones are freed below
+            struct dinode t = *dp;
+            dp->size = sp->size;
+            memmove(dp->addrs, sp->addrs, sizeof(dp->addrs));
+            dp->major = sp->major & ~I_NOINDEX;
+            sp->size = t.size;
+            memmove(sp->addrs, t.addrs, sizeof(sp->addrs));
+            sp->major = t.major & ~I_INDEX;
+            idirty(img, dp);
+        }
+        do_itruncate(img, sp, 0);
+        sp->type = 0;
+        idirty(img, sp);
+    }
+    trace_depth--;
+    idirty_flush(img);
+    return r;
+}
+
+static int dncmp(const void *x, const void *y) {
+    return strncmp(((struct dentry *)x)->name, ((struct dentry *)y)->name,
+                   DIRSIZ);
+}
+
+// rewrites the directory dp without unused entries and frees the blocks
+// no longer needed; the entries other than "." and ".." are sorted by
+// name if sort is true.  An indexed directory that does not fit in a
+// block is rebuilt by dindex, in which case the entries are in hash order
+// and the result is that of dindex.
+int dcompact(img_t img, inode_t dp, bool sort) {
+    if (dp->type != T_DIR)
+        return -1;
+    uint n, dot, dotdot;
+    struct dentry *ents = dentries(img, dp, &n, &dot, &dotdot);
+    if (ents == NULL)
+        return -1;
+    uint size = (n + 2) * sizeof(struct dirent);
+    if (is_indexed(dp) && size > img->bsize) {
+        free(ents);
+        dp->major &= ~I_INDEX;
+        return dindex(img, dp);
+    }
+    if (sort)
+        qsort(ents, n, sizeof(*ents), dncmp);
+    uchar *buf = malloc(size);
+    if (buf == NULL) {
+        free(ents);
+        return -1;
+    }
+    struct dentry de = dentry(img, ".", dot);
+    dstore(img, buf, &de);
+    de = dentry(img, "..", dotdot);
+    dstore(img, buf + sizeof(struct dirent), &de);
+    for (uint i = 0; i < n; i++)
+        dstore(img, buf + (i + 2) * sizeof(struct dirent), &ents[i]);
+    free(ents);
+    // the compacted directory may be indexed again when it grows
+    dp->major &= ~(I_INDEX | I_NOINDEX);
+    idirty(img, dp);
+    int r = 0;
+    if ((uint)iwrite(img, dp, buf, size, 0) != size) {
+        derror("dcompact: %u: write error\n", geti(img, dp));
+        r = -1;
+    }
+    else
+        itruncate(img, dp, size);
+    free(buf);
+    return r;
+}
+
+// search a file (name) in a directory (dp)
+static inode_t do_dlookup(img_t img, inode_t dp, char *name, uint *offp) {
+    assert(dp->type == T_DIR);
+    if (is_indexed(dp) && strncmp(name, ".", DIRSIZ) != 0 &&
+        strncmp(name, "..", DIRSIZ) != 0) {
+        uint inum, off;
+        if (dxlookup(img, dp, name, &inum, &off) == 0) {
+            if (inum == 0)
+                return NULL;
+            if (offp != NULL)
+                *offp = off;
+            return iget(img, inum);
+        }
+        dwarn("dlookup: %u: broken index\n", geti(img, dp));
+    }
+    struct dentry de;
+    for (uint off = 0; off < dp->size; off += sizeof(struct dirent)) {
+        if (dread(img, dp, &de, off) < 0) {
+            derror("dlookup: %s: read error\n", name);
+            return NULL;
+        }
+        if (de.inum != 0 && dnamecmp(img, name, de.name) == 0) {
+            if (offp != NULL)
+                *offp = off;
+            return iget(img, de.inum);
+        }
+    }
+    return NULL;
+}
+
+inode_t dlookup(img_t img, inode_t dp, char *name, uint *offp) {
+    trace_depth++;
+    inode_t r = do_dlookup(img, dp, name, offp);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_DLOOKUP, geti(img, dp), name, 0, 0, geti0(img, r));
+    return r;
+}
+
+// add a new directory entry in dp
+static int do_daddent(img_t img, inode_t dp, char *name, inode_t ip) {
+    uint inum = geti(img, ip);
+    if (!(img->features & FS_WIDEINUM) && inum > 0xffff) {
+        derror("daddent: %u: inode number too large\n", inum);
+        return -1;
+    }
+    // with FS_DIRINDEX, a directory is indexed when it outgrows a block,
+    // unless its index has been dropped before, which would make every
+    // later insertion rebuild the index and fail again
+    if ((img->features & FS_DIRINDEX) && !is_indexed(dp) &&
+        !(dp->major & I_NOINDEX) && dp->size >= img->bsize &&
+        (dindex(img, dp) != 0 || !is_indexed(dp))) {
+        dp->major |= I_NOINDEX;
+        idirty(img, dp);
+    }
+    int r = 1;
+    if (is_indexed(dp) && (r = dxadd(img, dp, name, inum)) > 0) {
+        // the directory remains valid without the index
+        dwarn("daddent: %u: index dropped\n", geti(img, dp));
+        dp->major = (dp->major & ~I_INDEX) | I_NOINDEX;
+        idirty(img, dp);
+    }
+    if (r > 0)
+        r = dladd(img, dp, name, inum);
+    if (r < 0)
+        return -1;
+    if (strncmp(name, ".", DIRSIZ) != 0) {
         ip->nlink++;
+        idirty(img, ip);
+    }
     return 0;
 }
 
+int daddent(img_t img, inode_t dp, char *name, inode_t ip) {
+    trace_depth++;
+    int r = do_daddent(img, dp, name, ip);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_LINK, geti(img, dp), name, 0, geti(img, ip), r);
+    idirty_flush(img);
+    return r;
+}
+
 // create a link to the parent directory
 int dmkparlink(img_t img, inode_t pip, inode_t cip) {
     if (pip->type != T_DIR) {
@@ -488,21 +2502,23 @@ int dmkparlink(img_t img, inode_t pip, inode_t cip) {
         return -1;
     }
     uint off;
-    dlookup(img, cip, "..", &off);
-    struct dirent de;
-    de.inum = geti(img, pip);
-    strncpy(de.name, "..", DIRSIZ);
-    if (iwrite(img, cip, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
+    if (dlookup(img, cip, "..", &off) == NULL) {
+        derror("dmkparlink: %d: no parent link\n", geti(img, cip));
+        return -1;
+    }
+    struct dentry de = dentry(img, "..", geti(img, pip));
+    if (dwrite(img, cip, &de, off) < 0) {
         derror("dmkparlink: write error\n");
         return -1;
     }
     pip->nlink++;
+    idirty(img, pip);
     return 0;
 }
 
 
 // returns the inode number of a file (rp/path)
-inode_t ilookup(img_t img, inode_t rp, char *path) {
+static inode_t do_ilookup(img_t img, inode_t rp, char *path) {
     char name[DIRSIZ + 1];
     name[DIRSIZ] = 0;
     while (true) {
@@ -526,8 +2542,19 @@ inode_t ilookup(img_t img, inode_t rp, char *path) {
     }
 }
 
+inode_t ilookup(img_t img, inode_t rp, char *path) {
+    uint64 t0 = lat_start();
+    trace_depth++;
+    inode_t r = do_ilookup(img, rp, path);
+    lat_end(LAT_ILOOKUP, t0);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_LOOKUP, geti(img, rp), path, 0, 0, geti0(img, r));
+    return r;
+}
+
 // create a file
-inode_t icreat(img_t img, inode_t rp, char *path, uint type, inode_t *dpp) {
+static inode_t do_icreat(img_t img, inode_t rp, char *path, uint type,
+                         inode_t *dpp) {
     char name[DIRSIZ + 1];
     name[DIRSIZ] = 0;
     while (true) {
@@ -546,6 +2573,13 @@ inode_t icreat(img_t img, inode_t rp, char *path, uint type, inode_t *dpp) {
             }
             ip = ialloc(img, type);
             daddent(img, rp, name, ip);
+            // the first block of the file is allocated near the last
+            // block of the directory (with the goal policies)
+            if (img->bpolicy == BP_GOAL || img->bpolicy == BP_BEST_FIT) {
+                img->bgoal_ip = ip;
+                img->bgoal = rp->size > 0 ?
+                    bmap(img, rp, (rp->size - 1) >> img->bshift) + 1 : 0;
+            }
             if (ip->type == T_DIR) {
                 daddent(img, ip, ".", ip);
                 daddent(img, ip, "..", rp);
@@ -562,12 +2596,24 @@ inode_t icreat(img_t img, inode_t rp, char *path, uint type, inode_t *dpp) {
     }
 }
 
+inode_t icreat(img_t img, inode_t rp, char *path, uint type, inode_t *dpp) {
+    uint64 t0 = lat_start();
+    trace_depth++;
+    inode_t r = do_icreat(img, rp, path, type, dpp);
+    lat_end(LAT_ICREAT, t0);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_CREATE, geti(img, rp), path, 0, type, geti0(img, r));
+    idirty_flush(img);
+    return r;
+}
+
 // checks if dp is an empty directory
 bool emptydir(img_t img, inode_t dp) {
     int nent = 0;
-    struct dirent de;
-    for (uint off = 0; off < dp->size; off += sizeof(de)) {
-        iread(img, dp, (uchar *)&de, sizeof(de), off);
+    struct dentry de;
+    for (uint off = 0; off < dp->size; off += sizeof(struct dirent)) {
+        if (dread(img, dp, &de, off) < 0)
+            return false;
         if (de.inum != 0)
             nent++;
     }
@@ -575,7 +2621,7 @@ bool emptydir(img_t img, inode_t dp) {
 }
 
 // unlinks a file (dp/path)
-int iunlink(img_t img, inode_t rp, char *path) {
+static int do_iunlink(img_t img, inode_t rp, char *path) {
     char name[DIRSIZ + 1];
     name[DIRSIZ] = 0;
     while (true) {
@@ -600,9 +2646,12 @@ int iunlink(img_t img, inode_t rp, char *path) {
                 derror("iunlink: write error\n");
                 return -1;
             }
-            if (ip->type == T_DIR && dlookup(img, ip, "..", NULL) == rp)
+            if (ip->type == T_DIR && dlookup(img, ip, "..", NULL) == rp) {
                 rp->nlink--;
+                idirty(img, rp);
+            }
             ip->nlink--;
+            idirty(img, ip);
             if (ip->nlink == 0) {
                 if (ip->type != T_DEV)
                     itruncate(img, ip, 0);
@@ -618,6 +2667,99 @@ int iunlink(img_t img, inode_t rp, char *path) {
     }
 }
 
+int iunlink(img_t img, inode_t rp, char *path) {
+    uint64 t0 = lat_start();
+    trace_depth++;
+    int r = do_iunlink(img, rp, path);
+    lat_end(LAT_IUNLINK, t0);
+    if (--trace_depth == 0 && trace_file != NULL)
+        trace(TR_UNLINK, geti(img, rp), path, 0, 0, r);
+    idirty_flush(img);
+    return r;
+}
+
+// advises that the first blocks (at most max) of the directory dp are
+// about to be read; returns the number of blocks advised
+uint ireadahead(img_t img, inode_t dp, uint max) {
+    if (readahead_window == 0 || dp->type != T_DIR || is_inline(img, dp))
+        return 0;
+    uint n = (dp->size + img->bsize - 1) >> img->bshift;
+    if (n > max)
+        n = max;
+    // adjacent blocks are advised together
+    uint start = 0, len = 0;
+    for (uint i = 0; i < n; i++) {
+        // not counted as lookups made by the operations
+        uint b = do_bmap(img, dp, i, false);
+        if (len > 0 && b == start + len)
+            len++;
+        else {
+            breadahead(img, start, len);
+            start = b;
+            len = 1;
+        }
+    }
+    breadahead(img, start, len);
+    return n;
+}
+
+// largest gap between the inode blocks advised by a single call
+#define RA_GAP 8
+
+// advises that the entries in the block of the directory dp containing
+// offset off are about to be visited: the inode blocks they refer to
+// and, if subdirs is true, the first blocks of the subdirectories among
+// them up to readahead_window blocks in total.  The inode blocks are all
+// advised before any of them is needed to find the subdirectories, so
+// that they are read in parallel.
+void dreadahead(img_t img, inode_t dp, uint off, bool subdirs) {
+    if (readahead_window == 0 || off >= dp->size || is_inline(img, dp))
+        return;
+    uint len = img->bsize - off % img->bsize;
+    if (len > dp->size - off)
+        len = dp->size - off;
+    const uchar *bp = BLK(img, do_bmap(img, dp, off >> img->bshift, false)) +
+        off % img->bsize;
+    const uint N = SBLK(img)->ninodes;
+    struct dentry de;
+    uint start = 0, n = 0;
+    for (uint k = 0; k + sizeof(struct dirent) <= len;
+         k += sizeof(struct dirent)) {
+        dload(img, &de, bp + k);
+        if (de.inum == 0 || de.inum >= N)
+            continue;
+        // inode blocks close to each other are advised together, gaps
+        // included, to save system calls
+        uint b = IBLK(img, de.inum);
+        if (n > 0 && b + RA_GAP >= start && b <= start + n + RA_GAP) {
+            if (b < start) {
+                n += start - b;
+                start = b;
+            }
+            else if (b >= start + n)
+                n = b - start + 1;
+        }
+        else {
+            breadahead(img, start, n);
+            start = b;
+            n = 1;
+        }
+    }
+    breadahead(img, start, n);
+    if (!subdirs)
+        return;
+    uint left = readahead_window;
+    for (uint k = 0; k + sizeof(struct dirent) <= len && left > 0;
+         k += sizeof(struct dirent)) {
+        dload(img, &de, bp + k);
+        if (de.inum == 0 || de.inum >= N ||
+            strncmp(de.name, ".", DIRSIZ) == 0 ||
+            strncmp(de.name, "..", DIRSIZ) == 0)
+            continue;
+        left -= ireadahead(img, iget(img, de.inum), left);
+    }
+}
+
 /* For Emacs
  * Local Variables: ***
  * c-file-style: "gnu" ***
@@ -18,38 +18,247 @@
 #define T_FILE 2   // File
 #define T_DEV  3   // Device
 
-#define MAXFILESIZE (MAXFILE * BSIZE)
 #define BUFSIZE 1024
 
-#define ddebug(...) debug_message("DEBUG", __VA_ARGS__)
-#define derror(...) debug_message("ERROR", __VA_ARGS__)
-#define dwarn(...) debug_message("WARNING", __VA_ARGS__)
+// supported block sizes (powers of 2)
+#define MINBSIZE 512
+#define MAXBSIZE 65536
+
+// log levels; messages above log_level are suppressed
+enum { LOG_NONE, LOG_ERROR, LOG_WARNING, LOG_DEBUG };
+
+#define dlog(level, ...) \
+    do { if ((level) <= log_level) log_message(level, __VA_ARGS__); } while (0)
+#define ddebug(...) dlog(LOG_DEBUG, __VA_ARGS__)
+#define derror(...) dlog(LOG_ERROR, __VA_ARGS__)
+#define dwarn(...) dlog(LOG_WARNING, __VA_ARGS__)
+
+extern int log_level;
 
 extern char *progname;
 extern jmp_buf fatal_exception_buf;
 
 uint bitcount(uint x);
 
-void debug_message(const char *tag, const char *fmt, ...);
+int log_setlevel(const char *name);
+void log_message(int level, const char *fmt, ...);
+void log_flush(void);
 void error(const char *fmt, ...);
 void fatal(const char *fmt, ...);
 char *typename(int type);
 
+// operation trace: a sequence of records following TRACE_MAGIC
+#define TRACE_MAGIC 0x31727470  // "ptr1"
+
+enum {
+    TR_LOOKUP = 1,  // ilookup(inum, path) = res (inode number or 0)
+    TR_DLOOKUP,     // dlookup(inum, path) = res (inode number or 0)
+    TR_CREATE,      // icreat(inum, path, type n) = res (inode number or 0)
+    TR_LINK,        // daddent(inum, path, inode n) = res
+    TR_UNLINK,      // iunlink(inum, path) = res
+    TR_READ,        // iread(inum, n bytes, off) = res
+    TR_WRITE,       // iwrite(inum, n bytes, off) = res
+    TR_TRUNCATE,    // itruncate(inum, size n) = res
+    TR_SESSION,     // start of a process: the allocation hints are reset
+    NTRACEOPS
+};
+
+// a trace record, followed by pathlen bytes of the path (not terminated)
+struct trace_rec {
+    uchar op;
+    uchar pad;
+    ushort pathlen;
+    uint inum;      // inode operated on (directory for path operations)
+    uint off;
+    uint n;
+    int res;        // result of the operation
+};
+
+extern FILE *trace_file;
+int trace_open(char *path);
+int trace_close(void);
+
+// performance counters of hot-path events, counted per thread only while
+// perf_enabled is set
+enum {
+    PC_BITMAP_BITS,     // bitmap bits scanned
+    PC_BALLOC,          // blocks allocated
+    PC_BFREE,           // blocks freed
+    PC_INODE_PROBES,    // inode slots probed by ialloc
+    PC_DIRENT_CMPS,     // directory entry names compared
+    PC_BMAP,            // bmap calls
+    PC_INDIRECT,        // lookups through indirect blocks
+    PC_INDIRECT_HITS,   // of which the remembered indirect block was used
+    PC_BYTES_COPIED,    // bytes copied by iread and iwrite
+    PC_IREAD,           // iread calls
+    PC_IWRITE,          // iwrite calls
+    PC_READAHEAD,       // blocks advised by readahead
+    NPERFCOUNTERS
+};
+
+extern bool perf_enabled;
+extern __thread uint64 perf_counters[NPERFCOUNTERS];
+extern const char *perf_names[NPERFCOUNTERS];
+
+#define PERF_ADD(c, n) \
+    do { if (perf_enabled) perf_counters[c] += (n); } while (0)
+
+// latency histograms of the public operations, recorded per thread only
+// while lat_enabled is set; each power of 2 of nanoseconds is divided into
+// 8 buckets, so quantiles are accurate to 12.5%
+enum {
+    LAT_ILOOKUP,
+    LAT_ICREAT,
+    LAT_IUNLINK,
+    LAT_IREAD,
+    LAT_IWRITE,
+    LAT_ITRUNCATE,
+    LAT_BALLOC,
+    LAT_IALLOC,
+    NLATOPS
+};
+
+#define NLATBUCKETS (16 + 60 * 8)
+
+struct histogram {
+    uint64 count;
+    uint64 sum;         // total (ns)
+    uint64 max;         // maximum (ns)
+    uint64 buckets[NLATBUCKETS];
+};
+
+extern bool lat_enabled;
+extern __thread struct histogram lat_histograms[NLATOPS];
+extern const char *lat_names[NLATOPS];
+
+uint64 hist_quantile(const struct histogram *h, double q);
+void lat_report(FILE *fp);
+
+// block access trace: a sequence of records following BLKTRACE_MAGIC;
+// the superblock is not recorded
+#define BLKTRACE_MAGIC 0x31727462  // "btr1"
+
+#define BA_WRITE 0x1    // the block is written (read otherwise)
+#define BA_META  0x2    // the block holds metadata
+
+struct blktrace_rec {
+    uint block;
+    uint flags;         // BA_*
+};
+
+extern FILE *blktrace_file;
+int blktrace_open(char *path);
+int blktrace_close(void);
+
+// inode
+typedef struct dinode *inode_t;
+
+// on-disk format variant
+// xv6-x86 has no magic number: its superblock is struct superblock
+// without the first field, which is expressed by a negative offset
+struct fsformat {
+    char *name;         // name of the variant
+    uint bsize;         // default block size
+    bool magic;         // the superblock starts with FSMAGIC
+    int sboff;          // offset of struct superblock in block 1
+};
+
+extern const struct fsformat fsformats[];
+extern const uint nfsformats;
+
 // a disk image as an array of blocks
-// a block is a uchar array of size BSIZE
-typedef uchar (*img_t)[BSIZE];
+// the geometry derived from the block size is computed once when the
+// image is loaded so that the block operations need no divisions
+struct img {
+    const struct fsformat *fmt;  // format variant
+    uchar *base;        // start address of the image
+    size_t size;        // size of the image (bytes)
+    uint bsize;         // block size (bytes)
+    uint bshift;        // log2(bsize)
+    uint ipb;           // inodes per block
+    uint bpb;           // bitmap bits per block
+    uint nindirect;     // block numbers per indirect block
+    uint features;      // format feature flags (FS_*)
+    uint ndirect;       // # of direct blocks in an inode
+    uint maxfile;       // maximum file size (blocks)
+    uint maxfilesize;   // maximum file size (bytes)
+    uint dirsiz;        // maximum length of file names
+    uint bhint;         // block where balloc starts searching (if not 0)
+    uint ihint;         // inode where ialloc starts searching
+    uint bpolicy;       // block allocation policy (BP_*)
+    uint bnext;         // block following the last one allocated
+    bool bclean;        // free blocks are zero-filled (a scratch image):
+                        //   balloc leaves them untouched, bfree clears them
+    inode_t bgoal_ip;   // file whose first block should be near bgoal
+    uint bgoal;         //   (set by icreat to a block of the directory)
+    inode_t bcache_ip;  // last singly-indirect block looked up by bmap
+    uint bcache_i1;     //   through the double-indirect block of bcache_ip
+    uint bcache_addr;   //   (its index and block number)
+};
+typedef struct img *img_t;
+
+// directory entry in either format (struct dirent or struct wdirent)
+struct dentry {
+    uint inum;
+    char name[DIRSIZ];  // only the first img->dirsiz bytes are significant
+};
+
+// start address of block b
+#define BLK(img, b) ((img)->base + ((size_t)(b) << (img)->bshift))
 
 // super block
-#define SBLK(img) ((struct superblock *)(img)[1])
-#define SBLKS(img) (*(SBLK(img)))
+#define SBLK(img) ((struct superblock *)(BLK(img, 1) + (img)->fmt->sboff))
+
+// block containing inode i
+#define IBLK(img, i) ((i) / (img)->ipb + SBLK(img)->inodestart)
+
+// block of free map containing bit for block b
+#define BBLK(img, b) ((b) / (img)->bpb + SBLK(img)->bmapstart)
+
+const struct fsformat *findformat(char *name);
+bool valid_bsize(uint bsize);
+
+// options of a file system to be made (newfs and genfs)
+struct fsopts {
+    const struct fsformat *fmt;
+    uint bsize;         // block size (0: that of fmt)
+    uint features;      // FS_*
+};
+
+void fsopts_init(struct fsopts *o);
+int fsopts_parse(struct fsopts *o, int argc, char *argv[], int *ip);
+int fsopts_check(struct fsopts *o);
+int fsopts_check_inodes(const struct fsopts *o, uint64 ninodes);
+uchar *createimg(char *file, uint64 size, int *fdp);
+int initimg(img_t img, const struct fsformat *fmt, uchar *base, size_t size,
+            uint bsize, uint features);
+int loadimg(img_t img, uchar *base, size_t size);
+void resethints(img_t img);
+int mkfs(img_t img, uint size, uint ninodes, uint nlog);
+uint fssize(img_t img, uint ndata, uint ninodes, uint nlog);
+
+// block allocation policies; the goal of an allocation for a file is the
+// block following the previous block of the file (or a block of its
+// directory for its first block)
+enum {
+    BP_FIRST_FIT,   // the first free block from the start (the default)
+    BP_NEXT_FIT,    // the first free block after the last one allocated
+    BP_BEST_FIT,    // the goal if free, otherwise the smallest free run
+    BP_GOAL,        // the first free block from the goal
+    NBPOLICIES
+};
+
+extern int balloc_policy;  // policy of the images initialized afterwards
+extern const char *balloc_policy_names[];
 
 bool valid_data_block(img_t img, uint b);
+int balloc_setpolicy(const char *name);
 uint balloc(img_t img);
+uint balloc_near(img_t img, uint goal);
+uint bfind_run(img_t img, uint n);
+bool balloc_at(img_t img, uint b);
 int bfree(img_t img, uint b);
 
-// inode
-typedef struct dinode *inode_t;
-
 // inode of the root directory
 extern const uint root_inode_number;
 extern inode_t root_inode;
@@ -59,10 +268,14 @@ uint geti(img_t img, inode_t ip);
 
 inode_t ialloc(img_t img, uint type);
 int ifree(img_t img, uint inum);
+bool is_inline(img_t img, inode_t ip);
+struct extent *iextent(img_t img, inode_t ip, uint i, bool alloc);
 uint bmap(img_t img, inode_t ip, uint n);
+int iblocks(img_t img, inode_t ip, int (*f)(img_t, uint, void *), void *arg);
 int iread(img_t img, inode_t ip, uchar *buf, uint n, uint off);
 int iwrite(img_t img, inode_t ip, uchar *buf, uint n, uint off);
 int itruncate(img_t img, inode_t ip, uint size);
+int iprealloc(img_t img, inode_t ip, uint size);
 
 bool is_empty(char *s);
 bool is_sep(char c);
@@ -71,12 +284,27 @@ char *splitpath(char *path, char *dirbuf, uint size);
 
 inode_t dlookup(img_t img, inode_t dp, char *name, uint *offp);
 int daddent(img_t img, inode_t dp, char *name, inode_t ip);
+void dload(img_t img, struct dentry *de, const uchar *p);
+void dstore(img_t img, uchar *p, const struct dentry *de);
+int dread(img_t img, inode_t dp, struct dentry *de, uint off);
+int dwrite(img_t img, inode_t dp, const struct dentry *de, uint off);
+bool is_indexed(inode_t dp);
+int dindex(img_t img, inode_t dp);
+int dcompact(img_t img, inode_t dp, bool sort);
 int dmkparlink(img_t img, inode_t pip, inode_t cip);
 inode_t ilookup(img_t img, inode_t rp, char *path);
 inode_t icreat(img_t img, inode_t rp, char *path, uint type, inode_t *dpp);
 bool emptydir(img_t img, inode_t dp);
 int iunlink(img_t img, inode_t rp, char *path);
 
+// readahead of the blocks about to be read by tree walks
+extern uint readahead_window;  // # of blocks of subdirectories advised
+                               // ahead (0: no readahead)
+void readahead_setwindow(uint n);
+void breadahead(img_t img, uint b, uint n);
+uint ireadahead(img_t img, inode_t dp, uint max);
+void dreadahead(img_t img, inode_t dp, uint off, bool subdirs);
+
 /* For Emacs
  * Local Variables: ***
  * c-file-style: "gnu" ***
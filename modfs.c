@@ -13,12 +13,16 @@
  *     superblock.logstart [val]
  *     superblock.inodestart [val]
  *     superblock.bmapstart [val]
+ *     superblock.bsize [val]
+ *     superblock.features [val]
  *     bitmap bnum [val]
  *     inode.type inum [val]
  *     inode.nlink inum [val]
  *     inode.size inum [val]
  *     inode.addrs inum n [val]
  *     inode.indirect inum [val]
+ *     inode.dindirect inum [val]
+ *     inode.extent inum i [start len]
  *     dirent path name [val]
  */
 
@@ -39,8 +43,14 @@
 // superblock.FIELD [val]
 int do_superblock(img_t img, int argc, char *argv[], char *field) {
     uint *f = NULL;
-    if (strcmp(field, "magic") == 0)
+    if (strcmp(field, "magic") == 0) {
+        if (!img->fmt->magic) {
+            error("superblock.magic: no magic number in %s\n",
+                  img->fmt->name);
+            return EXIT_FAILURE;
+        }
         f = &SBLK(img)->magic;
+    }
     else if (strcmp(field, "size") == 0)
         f = &SBLK(img)->size;
     else if (strcmp(field, "nblocks") == 0)
@@ -55,6 +65,10 @@ int do_superblock(img_t img, int argc, char *argv[], char *field) {
         f = &SBLK(img)->inodestart;
     else if (strcmp(field, "bmapstart") == 0)
         f = &SBLK(img)->bmapstart;
+    else if (strcmp(field, "bsize") == 0)
+        f = &SBLK(img)->bsize;
+    else if (strcmp(field, "features") == 0)
+        f = &SBLK(img)->features;
     else {
         error("no such field in superblock: %s\n", field);
         return EXIT_FAILURE;
@@ -73,7 +87,7 @@ int do_superblock(img_t img, int argc, char *argv[], char *field) {
         if (strcmp(field, "magic") == 0)
             *f = strtol(argv[0], NULL, 16);
         else
-            *f = atoi(argv[0]);
+            *f = strtoul(argv[0], NULL, 10);
     }
     return EXIT_SUCCESS;
 }
@@ -85,13 +99,13 @@ int do_bitmap(img_t img, int argc, char *argv[], char *field) {
         error("usage: %s img_file bitmap [val]\n", progname);
         return EXIT_FAILURE;
     }
-    uint bnum = atoi(argv[0]);
+    uint bnum = strtoul(argv[0], NULL, 10);
     if (bnum >= SBLK(img)->size) {
         error("bitmap: %u: invalid block number\n", bnum);
         return EXIT_FAILURE;
     }
-    uchar *bp = img[BBLOCK(bnum, SBLKS(img))];
-    int bi = bnum % BPB;
+    uchar *bp = BLK(img, BBLK(img, bnum));
+    int bi = bnum % img->bpb;
     int m = 1 << (bi % 8);
 
     if (argc == 1)
@@ -111,11 +125,39 @@ int do_bitmap(img_t img, int argc, char *argv[], char *field) {
     return EXIT_SUCCESS;
 }
 
+// returns the pointer to the entry holding the n-th block number of ip
+uint *addrslot(img_t img, inode_t ip, uint n) {
+    const uint NI = img->nindirect;
+    if (n < img->ndirect)
+        return &ip->addrs[n];
+    uint k = n - img->ndirect;
+    uint b = ip->addrs[img->ndirect];
+    if (k >= NI) {
+        k -= NI;
+        if (!(img->features & FS_DINDIRECT) || k / NI >= NI) {
+            error("inode: %u: invalid index number\n", n);
+            return NULL;
+        }
+        uint d = ip->addrs[img->ndirect + 1];
+        if (!valid_data_block(img, d)) {
+            error("inode: %u: not a valid data block\n", d);
+            return NULL;
+        }
+        b = ((uint *)BLK(img, d))[k / NI];
+        k %= NI;
+    }
+    if (!valid_data_block(img, b)) {
+        error("inode: %u: not a valid data block\n", b);
+        return NULL;
+    }
+    return (uint *)BLK(img, b) + k;
+}
+
 // inode.FIELD inum [args...]
 int do_inode(img_t img, int argc, char *argv[], char *field) {
     if (argc < 1)
         goto usage;
-    uint inum = atoi(argv[0]);
+    uint inum = strtoul(argv[0], NULL, 10);
     if (inum < 1 || inum >= SBLK(img)->ninodes) {
         error("inode: %u: invalid inode number\n", inum);
         return EXIT_FAILURE;
@@ -142,44 +184,65 @@ int do_inode(img_t img, int argc, char *argv[], char *field) {
         if (argc == 1)
             printf("%d\n", ip->size);
         else if (argc == 2)
-            ip->size = atoi(argv[1]);
+            ip->size = strtoul(argv[1], NULL, 10);
         else
             goto usage;
     }
     else if (strcmp(field, "indirect") == 0) {
         if (argc == 1)
-            printf("%d\n", ip->addrs[NDIRECT]);
+            printf("%d\n", ip->addrs[img->ndirect]);
+        else if (argc == 2)
+            ip->addrs[img->ndirect] = strtoul(argv[1], NULL, 10);
+        else
+            goto usage;
+    }
+    else if (strcmp(field, "dindirect") == 0) {
+        if (!(img->features & FS_DINDIRECT)) {
+            error("inode: no double-indirect blocks in this image\n");
+            return EXIT_FAILURE;
+        }
+        if (argc == 1)
+            printf("%d\n", ip->addrs[img->ndirect + 1]);
         else if (argc == 2)
-            ip->addrs[NDIRECT] = atoi(argv[1]);
+            ip->addrs[img->ndirect + 1] = strtoul(argv[1], NULL, 10);
         else
             goto usage;
     }
+    else if (strcmp(field, "extent") == 0) {
+        if (!(img->features & FS_EXTENTS)) {
+            error("inode: not an extent-based image\n");
+            return EXIT_FAILURE;
+        }
+        if (argc != 2 && argc != 4)
+            goto usage;
+        struct extent *e = iextent(img, ip, atoi(argv[1]), false);
+        if (e == NULL) {
+            error("inode: %s: no such extent\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        if (argc == 2)
+            printf("%u %u\n", e->start, e->len);
+        else {
+            e->start = strtoul(argv[2], NULL, 10);
+            e->len = strtoul(argv[3], NULL, 10);
+        }
+    }
     else if (strcmp(field, "addrs") == 0) {
         if (argc < 2)
             goto usage;
-        uint n = atoi(argv[1]);
-        if (n < NDIRECT) {
-            if (argc == 2)
-                printf("%d\n", ip->addrs[n]);
-            else if (argc == 3)
-                ip->addrs[n] = atoi(argv[2]);
-            else
-                goto usage;
-        }
-        else if (NDIRECT <= n && n < NDIRECT + NINDIRECT) {
-            uint b = ip->addrs[NDIRECT];
-            if (!valid_data_block(img, b)) {
-                error("inode: %u: not a valid data block\n", b);
-                return EXIT_FAILURE;
-            }
-            uint *ib = (uint *)img[b];
-            if (argc == 2)
-                printf("%d\n", ib[n - NDIRECT]);
-            else if (argc == 3)
-                ib[n - NDIRECT] = atoi(argv[2]);
-            else
-                goto usage;
+        if (img->features & FS_EXTENTS) {
+            error("inode: an extent-based image (use inode.extent)\n");
+            return EXIT_FAILURE;
         }
+        uint *slot = addrslot(img, ip, atoi(argv[1]));
+        if (slot == NULL)
+            return EXIT_FAILURE;
+        if (argc == 2)
+            printf("%d\n", *slot);
+        else if (argc == 3)
+            *slot = strtoul(argv[2], NULL, 10);
+        else
+            goto usage;
     }
     else
         assert(false);
@@ -188,7 +251,8 @@ int do_inode(img_t img, int argc, char *argv[], char *field) {
 
  usage:
     error("usage: %s img_file inode.%s inum %s\n", progname, field,
-          strcmp(field, "addrs") == 0 ? "n [val]" : "[val]");
+          strcmp(field, "addrs") == 0 ? "n [val]" :
+          strcmp(field, "extent") == 0 ? "i [start len]" : "[val]");
     return EXIT_FAILURE;
 }
 
@@ -233,18 +297,18 @@ int do_dirent(img_t img, int argc, char *argv[], char *field) {
             }
         }
         else {
-            uint inum = atoi(argv[2]);
+            uint inum = strtoul(argv[2], NULL, 10);
             if (ip == NULL) {
                 error("dirent: %s: no such file or directory\n", name);
                 return EXIT_FAILURE;
             }
-            struct dirent de;
-            if (iread(img, dp, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
+            struct dentry de;
+            if (dread(img, dp, &de, off) < 0) {
                 error("dirent: %s: read error\n", name);
                 return EXIT_FAILURE;
             }
             de.inum = inum;
-            if (iwrite(img, dp, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
+            if (dwrite(img, dp, &de, off) < 0) {
                 error("dirent: %s: write error\n", name);
                 return EXIT_FAILURE;
             }
@@ -271,12 +335,16 @@ struct cmd_table_ent cmd_table[] = {
     { "superblock.logstart", "[val]", do_superblock, "logstart" },
     { "superblock.inodestart", "[val]", do_superblock, "inodestart" },
     { "superblock.bmapstart", "[val]", do_superblock, "bmapstart" },
+    { "superblock.bsize", "[val]", do_superblock, "bsize" },
+    { "superblock.features", "[val]", do_superblock, "features" },
     { "bitmap", "bnum [val]", do_bitmap, NULL },
     { "inode.type", "inum [val]", do_inode, "type" },
     { "inode.nlink", "inum [val]", do_inode, "nlink" },
     { "inode.size", "inum [val]", do_inode, "size" },
     { "inode.addrs", "inum n [val]", do_inode, "addrs" },
     { "inode.indirect", "inum [val]", do_inode, "indirect" },
+    { "inode.dindirect", "inum [val]", do_inode, "dindirect" },
+    { "inode.extent", "inum i [start len]", do_inode, "extent" },
     { "dirent", "path name [val]", do_dirent, NULL },
 };
 
@@ -315,14 +383,21 @@ int main(int argc, char *argv[]) {
     }
     size_t img_size = (size_t)img_sbuf.st_size;
 
-    img_t img = mmap(NULL, img_size, PROT_READ | PROT_WRITE,
-                     MAP_SHARED, img_fd, 0);
-    if (img == MAP_FAILED) {
+    uchar *img_base = mmap(NULL, img_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, img_fd, 0);
+    if (img_base == MAP_FAILED) {
         perror(img_file);
         close(img_fd);
         return EXIT_FAILURE;
     }
 
+    // a broken superblock is accessed with the default block size so
+    // that it can be repaired
+    struct img img_buf;
+    img_t img = &img_buf;
+    if (loadimg(img, img_base, img_size) < 0)
+        initimg(img, &fsformats[0], img_base, img_size, BSIZE, 0);
+
     root_inode = iget(img, root_inode_number);
 
     // shift argc and argv to point the first command argument
@@ -330,7 +405,7 @@ int main(int argc, char *argv[]) {
     if (setjmp(fatal_exception_buf) == 0)
         status = exec_cmd(img, cmd, argc - 3, argv + 3);
 
-    munmap(img, img_size);
+    munmap(img_base, img_size);
     close(img_fd);
 
     return status;
@@ -3,12 +3,29 @@
  * Copyright (c) 2015-2019 Takuo Watanabe
  */
 
-/* usage: newfs img_file size ninodes nlog 
+/* usage: newfs [--format format] [--bsize bsize] [--dindirect | --extents]
+ *              [--inline] [--dir-index] [--wide-inum]
+ *              img_file size ninodes nlog
+ *        newfs [options] --fit manifest|hostdir [--slack percent]
+ *              img_file nlog
+ *     format : xv6-riscv (default) or xv6-x86
+ *     bsize : block size (default: 1024 for xv6-riscv, 512 for xv6-x86)
+ *     --dindirect : use a double-indirect block for large files
+ *     --extents : store extents instead of block numbers in inodes
+ *     --inline : store small files in their inodes
+ *     --dir-index : index directories that outgrow a block
+ *     --wide-inum : use 32-bit inode numbers in directory entries
+ *     --fit : compute size and ninodes from the content listed in a
+ *             manifest or found in a host directory
+ *     --slack : percentage of blocks and inodes added to the content
+ *               (default: 0)
  *     size : total # of blocks
  *     ninodes : # of inodes
  *     nlog : # of log blocks
  */
 
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -20,18 +37,18 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <ftw.h>
 
 #include "libfs.h"
 
 int setupfs(img_t img, uint size, uint ninodes, uint nlog) {
-    uint niblocks = ninodes / IPB + 1;
-    uint nmblocks = size / (BSIZE * 8) + 1;
+    uint niblocks = ninodes / img->ipb + 1;
+    uint nmblocks = size / img->bpb + 1;
     uint nblocks = size - (2 + nlog + niblocks + nmblocks);
-    uint logstart = 2;
-    uint inodestart = logstart + nlog;
-    uint bmapstart = inodestart + niblocks;
-    uint dstart = bmapstart + nmblocks;
 
+    printf("format: %s\n", img->fmt->name);
+    printf("block size: %u\n", img->bsize);
+    printf("maximum file size (bytes): %u\n", img->maxfilesize);
     printf("# of blocks: %u\n", size);
     printf("# of inodes: %u\n", ninodes);
     printf("# of log blocks: %u\n", nlog);
@@ -39,71 +56,403 @@ int setupfs(img_t img, uint size, uint ninodes, uint nlog) {
     printf("# of bitmap blocks: %u\n", nmblocks);
     printf("# of data blocks: %u\n", nblocks);
 
-    // clear all blocks
-    memset((uchar *)img, 0, BSIZE * size);
-
-    // setup superblock
-    struct superblock sblk = {
-        FSMAGIC,
-        size, nblocks, ninodes, nlog, logstart, inodestart, bmapstart
-    };
-    memmove(img[1], (uchar *)&sblk, sizeof(sblk));
-
-    // setup initial bitmap
-    for (uint b = 0; b < dstart; b += BPB) {
-        uchar *bp = img[BBLOCK(b, SBLKS(img))];
-        for (int bi = 0; bi < BPB && b + bi < dstart; bi++) {
-            int m = 1 << (bi % 8);
-            bp[bi / 8] |= m;
-        }
+    if (mkfs(img, size, ninodes, nlog) < 0)
+        return EXIT_FAILURE;
+    root_inode = iget(img, root_inode_number);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Geometry fitting (--fit)
+ *
+ * The content is first created in a scratch image with empty files whose
+ * blocks are then reserved by iprealloc, so that the data, indirect,
+ * extent and directory blocks (including the index blocks of indexed
+ * directories) are counted by the same code that fills the real image.
+ */
+
+// an entry of the content
+struct fit_ent {
+    char type;          // 'd', 'f', 'c' (device) or 'l' (hard link)
+    uint64 size;        // size of a file
+    char *path;
+    char *target;       // file to which a hard link refers
+};
+
+struct fit_list {
+    struct fit_ent *ents;
+    uint n, cap;
+    // regular files of the host directory with more than one link
+    struct { dev_t dev; ino_t ino; char *path; } *links;
+    uint nlinks, maxlinks;
+    // directories in the list (open addressing, for manifests)
+    char **dirs;
+    uint ndirs, dirscap;
+};
+
+static int fit_add(struct fit_list *l, char type, uint64 size,
+                   const char *path, const char *target) {
+    if (l->n == l->cap) {
+        uint cap = l->cap == 0 ? 1024 : 2 * l->cap;
+        struct fit_ent *p = realloc(l->ents, cap * sizeof(*p));
+        if (p == NULL)
+            return -1;
+        l->ents = p;
+        l->cap = cap;
     }
+    struct fit_ent *e = &l->ents[l->n];
+    e->type = type;
+    e->size = size;
+    e->path = strdup(path);
+    e->target = target != NULL ? strdup(target) : NULL;
+    if (e->path == NULL || (target != NULL && e->target == NULL))
+        return -1;
+    l->n++;
+    return 0;
+}
 
-    // setup root directory
-    root_inode = ialloc(img, T_DIR);
-    assert(geti(img, root_inode) == root_inode_number);
+static uint fit_hash(const char *s, size_t n) {
+    uint h = 2166136261u;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (uchar)s[i]) * 16777619u;
+    return h;
+}
 
-    daddent(img, root_inode, ".", root_inode);
-    daddent(img, root_inode, "..", root_inode);
+// adds the directory of the first n bytes of path to the list unless it
+// is already there; returns -1 on error
+static int fit_add_dir(struct fit_list *l, const char *path, size_t n) {
+    if (2 * (l->ndirs + 1) > l->dirscap) {
+        uint cap = l->dirscap == 0 ? 1024 : 2 * l->dirscap;
+        char **dirs = calloc(cap, sizeof(char *));
+        if (dirs == NULL)
+            return -1;
+        for (uint i = 0; i < l->dirscap; i++) {
+            if (l->dirs[i] == NULL)
+                continue;
+            uint h = fit_hash(l->dirs[i], strlen(l->dirs[i])) & (cap - 1);
+            while (dirs[h] != NULL)
+                h = (h + 1) & (cap - 1);
+            dirs[h] = l->dirs[i];
+        }
+        free(l->dirs);
+        l->dirs = dirs;
+        l->dirscap = cap;
+    }
+    uint h = fit_hash(path, n) & (l->dirscap - 1);
+    for (; l->dirs[h] != NULL; h = (h + 1) & (l->dirscap - 1))
+        if (strncmp(l->dirs[h], path, n) == 0 && l->dirs[h][n] == 0)
+            return 0;
+    char buf[BUFSIZE];
+    snprintf(buf, sizeof(buf), "%.*s", (int)n, path);
+    if (fit_add(l, 'd', 0, buf, NULL) < 0)
+        return -1;
+    l->dirs[h] = l->ents[l->n - 1].path;
+    l->ndirs++;
+    return 0;
+}
 
-    return EXIT_SUCCESS;
+// adds the directories of path (and path itself if it is a directory)
+// missing in the list so that each directory precedes its entries
+static int fit_add_dirs(struct fit_list *l, const char *path, bool isdir) {
+    size_t len = strlen(path);
+    for (size_t n = 1; n <= len; n++)
+        if ((n == len ? isdir : is_sep(path[n])) && !is_sep(path[n - 1]) &&
+            fit_add_dir(l, path, n) < 0)
+            return -1;
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "usage: %s file size ninodes nlog\n", argv[0]);
-        return EXIT_FAILURE;
+static void fit_free(struct fit_list *l) {
+    free(l->dirs);
+    for (uint i = 0; i < l->n; i++) {
+        free(l->ents[i].path);
+        free(l->ents[i].target);
     }
-    char *file = argv[1];
-    uint size = atoi(argv[2]);
-    uint ninodes = atoi(argv[3]);
-    uint nlog = atoi(argv[4]);
+    free(l->ents);
+    free(l->links);
+}
 
-    int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
+// reads a manifest: each line is "d path", "f size path", "c path" or
+// "l target path", and empty lines and lines beginning with # are ignored
+static int fit_read_manifest(struct fit_list *l, char *file) {
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL) {
         perror(file);
-        return EXIT_FAILURE;
+        return -1;
     }
+    char line[BUFSIZE], target[BUFSIZE];
+    int r = 0;
+    for (uint lineno = 1; r == 0 && fgets(line, sizeof(line), fp) != NULL;
+         lineno++) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] == 0 || line[0] == '#')
+            continue;
+        unsigned long long size = 0;
+        int pos = 0;
+        if ((line[0] == 'd' || line[0] == 'c') && line[1] == ' ')
+            pos = 2;
+        else if (line[0] == 'f')
+            sscanf(line, "f %llu %n", &size, &pos);
+        else if (line[0] == 'l')
+            sscanf(line, "l %1023s %n", target, &pos);
+        if (pos == 0 || line[pos] == 0) {
+            error("%s: %u: invalid line\n", file, lineno);
+            r = -1;
+        }
+        else if (fit_add_dirs(l, line + pos, line[0] == 'd') < 0 ||
+                 (line[0] != 'd' &&
+                  fit_add(l, line[0], size, line + pos,
+                          line[0] == 'l' ? target : NULL) < 0)) {
+            error("%s: out of memory\n", progname);
+            r = -1;
+        }
+    }
+    fclose(fp);
+    return r;
+}
 
-    size_t img_size = BSIZE * size;
-    lseek(fd, img_size - 1, SEEK_SET);
-    char c = 0;
-    if (write(fd, &c, 1) < 0) {
-        perror(file);
-        return EXIT_FAILURE;
+// the list being made by fit_read_dir and the length of its root path
+static struct fit_list *fit_cur;
+static size_t fit_rootlen;
+
+// adds a file found by nftw; hard links are detected by the device and
+// inode numbers of the files with more than one link
+static int fit_visit(const char *hpath, const struct stat *st, int flag,
+                     struct FTW *ftw) {
+    struct fit_list *l = fit_cur;
+    const char *path = hpath + fit_rootlen;
+    if (ftw->level == 0)
+        return 0;
+    if (flag == FTW_DNR || flag == FTW_NS) {
+        error("%s: %s: cannot read\n", progname, hpath);
+        return -1;
+    }
+    if (S_ISDIR(st->st_mode))
+        return fit_add(l, 'd', 0, path, NULL);
+    if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+        return fit_add(l, 'c', 0, path, NULL);
+    if (!S_ISREG(st->st_mode)) {
+        error("%s: %s: skipped (not a regular file, directory or device)\n",
+              progname, hpath);
+        return 0;
     }
+    if (st->st_nlink == 1)
+        return fit_add(l, 'f', st->st_size, path, NULL);
+    for (uint i = 0; i < l->nlinks; i++)
+        if (l->links[i].dev == st->st_dev && l->links[i].ino == st->st_ino)
+            return fit_add(l, 'l', 0, path, l->links[i].path);
+    if (l->nlinks == l->maxlinks) {
+        uint n = l->maxlinks == 0 ? 64 : 2 * l->maxlinks;
+        void *p = realloc(l->links, n * sizeof(*l->links));
+        if (p == NULL)
+            return -1;
+        l->links = p;
+        l->maxlinks = n;
+    }
+    if (fit_add(l, 'f', st->st_size, path, NULL) < 0)
+        return -1;
+    l->links[l->nlinks].dev = st->st_dev;
+    l->links[l->nlinks].ino = st->st_ino;
+    l->links[l->nlinks++].path = l->ents[l->n - 1].path;
+    return 0;
+}
 
-    img_t img = mmap(NULL, img_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (img == MAP_FAILED) {
-        perror(file);
-        close(fd);
+// walks the host directory dir
+static int fit_read_dir(struct fit_list *l, char *dir) {
+    fit_cur = l;
+    fit_rootlen = strlen(dir);
+    while (fit_rootlen > 1 && dir[fit_rootlen - 1] == '/')
+        fit_rootlen--;
+    if (nftw(dir, fit_visit, 64, FTW_PHYS) != 0) {
+        error("%s: %s: cannot read the directory\n", progname, dir);
+        return -1;
+    }
+    return 0;
+}
+
+// creates the content in the scratch image
+static int fit_build(img_t img, struct fit_list *l) {
+    for (uint i = 0; i < l->n; i++) {
+        struct fit_ent *e = &l->ents[i];
+        inode_t ip = ilookup(img, root_inode, e->path);
+        if (e->type == 'd' && ip != NULL && ip->type == T_DIR)
+            continue;
+        if (ip != NULL) {
+            error("%s: %s: duplicate entry\n", progname, e->path);
+            return -1;
+        }
+        if (e->type == 'l') {
+            char dir[BUFSIZE];
+            char *name = splitpath(e->path, dir, sizeof(dir));
+            inode_t sip = ilookup(img, root_inode, e->target);
+            if (sip == NULL || sip->type != T_FILE ||
+                daddent(img, ilookup(img, root_inode, dir), name, sip) < 0) {
+                error("%s: %s: cannot link to %s\n", progname, e->path,
+                      e->target);
+                return -1;
+            }
+            continue;
+        }
+        uint type = e->type == 'd' ? T_DIR : e->type == 'c' ? T_DEV : T_FILE;
+        if (type == T_FILE && e->size > img->maxfilesize) {
+            error("%s: %s: %lu bytes: file too large\n", progname, e->path,
+                  e->size);
+            return -1;
+        }
+        ip = icreat(img, root_inode, e->path, type, NULL);
+        if (ip == NULL ||
+            (type == T_FILE && iprealloc(img, ip, e->size) < 0)) {
+            error("%s: %s: cannot create\n", progname, e->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// computes the # of blocks and inodes for the content of src (a manifest
+// or a host directory) with slack percent to spare
+static int fit_geometry(char *src, double slack, const struct fsopts *o,
+                        uint nlog, uint *sizep, uint *ninodesp) {
+    uint bsize = o->bsize;
+    struct fit_list l = { 0 };
+    struct stat st;
+    int r = stat(src, &st) == 0 && S_ISDIR(st.st_mode) ?
+        fit_read_dir(&l, src) : fit_read_manifest(&l, src);
+    if (r < 0) {
+        fit_free(&l);
+        return -1;
+    }
+
+    // the scratch image is large enough for any layout; it is allocated
+    // lazily and its data blocks are only reserved in the bitmap, never
+    // zeroed, so only the blocks written (metadata) take memory
+    struct img img_buf;
+    img_t img = &img_buf;
+    initimg(img, o->fmt, NULL, 0, bsize, o->features);
+    uint64 nblocks = 64, nents = 2;
+    for (uint i = 0; i < l.n; i++) {
+        uint64 n = (l.ents[i].size + bsize - 1) / bsize;
+        nblocks += n + n / img->nindirect + 3;
+        nents += l.ents[i].type == 'd' ? 3 : 1;
+    }
+    nblocks += 3 * (nents * sizeof(struct dirent) / bsize + l.n);
+    uint64 ninodes = 2 + (uint64)l.n;
+    if (fsopts_check_inodes(o, ninodes) < 0) {
+        fit_free(&l);
+        return -1;
+    }
+    uint64 size = 2 + nlog + ninodes / img->ipb + 1 + nblocks / img->bpb + 1 +
+        nblocks;
+    if (size > 0xffffffffUL || ninodes > 0xffffffffUL) {
+        error("%s: %s: too large\n", progname, src);
+        fit_free(&l);
+        return -1;
+    }
+    uchar *base = calloc(size, bsize);
+    if (base == NULL) {
+        error("%s: out of memory\n", progname);
+        fit_free(&l);
+        return -1;
+    }
+    initimg(img, o->fmt, base, size * bsize, bsize, o->features);
+    img->bclean = true;
+    r = -1;
+    if (setjmp(fatal_exception_buf) == 0 &&
+        mkfs(img, size, ninodes, nlog) == 0) {
+        root_inode = iget(img, root_inode_number);
+        r = fit_build(img, &l);
+    }
+
+    if (r == 0) {
+        // data blocks and inodes used
+        struct superblock *sb = SBLK(img);
+        uint nused = 0, nifree = 0;
+        for (uint b = sb->size - sb->nblocks; b < sb->size; b++)
+            nused += (BLK(img, BBLK(img, b))[b % img->bpb / 8] >>
+                      (b % 8)) & 1;
+        for (uint i = 1; i < sb->ninodes; i++)
+            nifree += iget(img, i)->type == 0;
+        uint niused = sb->ninodes - nifree;
+        printf("content: %u entries, %u inodes, %u data blocks\n", l.n,
+               niused - 1, nused);
+
+        uint nd = nused + (uint)(nused * slack / 100 + 0.999999);
+        uint ni = niused + (uint)((niused - 1) * slack / 100 + 0.999999);
+        *sizep = fssize(img, nd, ni, nlog);
+        *ninodesp = ni;
+    }
+    free(base);
+    fit_free(&l);
+    return r;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: %s [--format format] [--bsize bsize] "
+            "[--dindirect | --extents] [--inline] [--dir-index] "
+            "[--wide-inum] file size ninodes nlog\n", progname);
+    fprintf(stderr, "       %s [options] --fit manifest|hostdir "
+            "[--slack percent] file nlog\n", progname);
+}
+
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    struct fsopts o;
+    fsopts_init(&o);
+    char *fit_src = NULL;
+    double slack = 0;
+    int i;
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        int r = fsopts_parse(&o, argc, argv, &i);
+        if (r < 0)
+            return EXIT_FAILURE;
+        if (r > 0)
+            continue;
+        if (strcmp(argv[i], "--fit") == 0 && i + 1 < argc)
+            fit_src = argv[++i];
+        else if (strcmp(argv[i], "--slack") == 0 && i + 1 < argc)
+            slack = strtod(argv[++i], NULL);  // a trailing % is ignored
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - i != (fit_src != NULL ? 2 : 4) || slack < 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (fsopts_check(&o) < 0)
         return EXIT_FAILURE;
+    char *file = argv[i];
+    uint size, ninodes, nlog;
+    if (fit_src != NULL) {
+        nlog = strtoul(argv[i + 1], NULL, 10);
+        if (fit_geometry(fit_src, slack, &o, nlog, &size, &ninodes) < 0)
+            return EXIT_FAILURE;
+    }
+    else {
+        size = strtoul(argv[i + 1], NULL, 10);
+        ninodes = strtoul(argv[i + 2], NULL, 10);
+        nlog = strtoul(argv[i + 3], NULL, 10);
     }
+    if (fsopts_check_inodes(&o, ninodes) < 0)
+        return EXIT_FAILURE;
+
+    // the image size may exceed 4 GiB
+    uint64 img_size = (uint64)o.bsize * size;
+    int fd;
+    uchar *img_base = createimg(file, img_size, &fd);
+    if (img_base == NULL)
+        return EXIT_FAILURE;
+
+    struct img img_buf;
+    img_t img = &img_buf;
+    initimg(img, o.fmt, img_base, img_size, o.bsize, o.features);
 
     int status = EXIT_FAILURE;
     if (setjmp(fatal_exception_buf) == 0)
         status = setupfs(img, size, ninodes, nlog);
 
-    munmap(img, img_size);
+    munmap(img_base, img_size);
     close(fd);
 
     return status;
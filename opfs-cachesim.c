@@ -0,0 +1,287 @@
+/*
+ * opfs: a simple utility for simulating block caches on block access traces
+ * Copyright (c) 2015-2020 Takuo Watanabe
+ */
+
+/* usage: opfs-cachesim blktrace_file [size...]
+ *     blktrace_file : block access trace recorded by opfs --block-trace
+ *     size : cache size in blocks (default: powers of 2 from 8 up to the
+ *            # of distinct blocks)
+ *
+ * The accesses are replayed through LRU and ARC caches of each size and
+ * the miss ratios of all accesses and of metadata accesses are printed.
+ * Writes are treated like reads (a write-back cache).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include "libfs.h"
+
+/*
+ * Cache models
+ *
+ * Each block is on at most one list, so the lists are linked through
+ * arrays indexed by block numbers; the lists are circular and the
+ * sentinel of list l is the element nblocks + l.  The head of a list is
+ * its most recently used element.
+ */
+
+enum { L_NONE, L_T1, L_T2, L_B1, L_B2, NLISTS };
+
+struct cache {
+    uint cap;           // capacity in blocks
+    uint nblocks;       // # of elements other than the sentinels
+    uint *prev, *next;
+    uchar *where;       // list of each block (L_*)
+    uint len[NLISTS];
+    uint p;             // target size of T1 (ARC)
+};
+
+static struct cache *cache_new(uint cap, uint nblocks) {
+    struct cache *c = calloc(1, sizeof(struct cache));
+    uint n = nblocks + NLISTS;
+    c->prev = malloc(n * sizeof(uint));
+    c->next = malloc(n * sizeof(uint));
+    c->where = calloc(n, 1);
+    if (c->prev == NULL || c->next == NULL || c->where == NULL) {
+        error("%s: out of memory\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    c->cap = cap;
+    c->nblocks = nblocks;
+    for (uint l = 0; l < NLISTS; l++) {
+        uint s = nblocks + l;
+        c->prev[s] = c->next[s] = s;
+    }
+    return c;
+}
+
+static void cache_free(struct cache *c) {
+    free(c->prev);
+    free(c->next);
+    free(c->where);
+    free(c);
+}
+
+static void unlink_block(struct cache *c, uint b) {
+    c->next[c->prev[b]] = c->next[b];
+    c->prev[c->next[b]] = c->prev[b];
+    c->len[c->where[b]]--;
+    c->where[b] = L_NONE;
+}
+
+// makes b the most recently used element of list l
+static void push(struct cache *c, uint l, uint b) {
+    if (c->where[b] != L_NONE)
+        unlink_block(c, b);
+    uint s = c->nblocks + l;
+    c->prev[b] = s;
+    c->next[b] = c->next[s];
+    c->prev[c->next[s]] = b;
+    c->next[s] = b;
+    c->where[b] = l;
+    c->len[l]++;
+}
+
+// the least recently used element of list l
+static uint lru(struct cache *c, uint l) {
+    return c->prev[c->nblocks + l];
+}
+
+// LRU; returns true on a hit
+static bool lru_access(struct cache *c, uint b) {
+    if (c->where[b] == L_T1) {
+        push(c, L_T1, b);
+        return true;
+    }
+    if (c->len[L_T1] == c->cap)
+        unlink_block(c, lru(c, L_T1));
+    push(c, L_T1, b);
+    return false;
+}
+
+// moves the LRU element of T1 or T2 to its ghost list (B1 or B2) if the
+// cache is full
+static void arc_replace(struct cache *c, bool in_b2) {
+    if (c->len[L_T1] + c->len[L_T2] < c->cap)
+        return;
+    if (c->len[L_T2] == 0 || (c->len[L_T1] > 0 &&
+        ((in_b2 && c->len[L_T1] == c->p) || c->len[L_T1] > c->p)))
+        push(c, L_B1, lru(c, L_T1));
+    else
+        push(c, L_B2, lru(c, L_T2));
+}
+
+// ARC (Megiddo and Modha, FAST 2003); returns true on a hit
+static bool arc_access(struct cache *c, uint b) {
+    uint l1, l2, d;
+    switch (c->where[b]) {
+    case L_T1:
+    case L_T2:
+        push(c, L_T2, b);
+        return true;
+    case L_B1:
+        d = c->len[L_B1] >= c->len[L_B2] ? 1 : c->len[L_B2] / c->len[L_B1];
+        c->p = c->p + d < c->cap ? c->p + d : c->cap;
+        arc_replace(c, false);
+        push(c, L_T2, b);
+        return false;
+    case L_B2:
+        d = c->len[L_B2] >= c->len[L_B1] ? 1 : c->len[L_B1] / c->len[L_B2];
+        c->p = c->p > d ? c->p - d : 0;
+        arc_replace(c, true);
+        push(c, L_T2, b);
+        return false;
+    }
+    l1 = c->len[L_T1] + c->len[L_B1];
+    l2 = c->len[L_T2] + c->len[L_B2];
+    if (l1 == c->cap) {
+        if (c->len[L_T1] < c->cap) {
+            unlink_block(c, lru(c, L_B1));
+            arc_replace(c, false);
+        }
+        else
+            unlink_block(c, lru(c, L_T1));
+    }
+    else if (l1 + l2 >= c->cap) {
+        if (l1 + l2 == 2 * c->cap)
+            unlink_block(c, lru(c, L_B2));
+        arc_replace(c, false);
+    }
+    push(c, L_T1, b);
+    return false;
+}
+
+/*
+ * Simulation
+ */
+
+struct result {
+    uint64 misses, meta_misses;
+};
+
+static void simulate(struct blktrace_rec *recs, uint64 n, uint nblocks,
+                     uint cap, bool (*access)(struct cache *, uint),
+                     struct result *r) {
+    struct cache *c = cache_new(cap, nblocks);
+    for (uint64 i = 0; i < n; i++) {
+        if (!access(c, recs[i].block)) {
+            r->misses++;
+            if (recs[i].flags & BA_META)
+                r->meta_misses++;
+        }
+    }
+    cache_free(c);
+}
+
+// reads the whole trace file; returns the # of records or -1
+static long load_trace(char *path, struct blktrace_rec **recsp) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    uint magic;
+    if (fread(&magic, sizeof(magic), 1, fp) != 1 ||
+        magic != BLKTRACE_MAGIC) {
+        error("%s: not a block trace file\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long n = (ftell(fp) - (long)sizeof(magic)) / sizeof(struct blktrace_rec);
+    fseek(fp, sizeof(magic), SEEK_SET);
+    struct blktrace_rec *recs = malloc((n > 0 ? n : 1) * sizeof(*recs));
+    if (recs == NULL || fread(recs, sizeof(*recs), n, fp) != (size_t)n) {
+        error("%s: cannot read the trace\n", path);
+        fclose(fp);
+        free(recs);
+        return -1;
+    }
+    fclose(fp);
+    *recsp = recs;
+    return n;
+}
+
+static double ratio(uint64 x, uint64 y) {
+    return y == 0 ? 0 : 100.0 * x / y;
+}
+
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    if (argc < 2) {
+        error("usage: %s blktrace_file [size...]\n", progname);
+        return EXIT_FAILURE;
+    }
+    struct blktrace_rec *recs;
+    long n = load_trace(argv[1], &recs);
+    if (n < 0)
+        return EXIT_FAILURE;
+
+    uint nblocks = 0;
+    uint64 nwrites = 0, nmeta = 0;
+    for (long i = 0; i < n; i++) {
+        if (recs[i].block >= nblocks)
+            nblocks = recs[i].block + 1;
+        nwrites += (recs[i].flags & BA_WRITE) != 0;
+        nmeta += (recs[i].flags & BA_META) != 0;
+    }
+    uchar *seen = calloc(nblocks + 1, 1);
+    uint ndistinct = 0, nmeta_distinct = 0;
+    for (long i = 0; i < n; i++) {
+        if (seen[recs[i].block] == 0) {
+            ndistinct++;
+            nmeta_distinct += (recs[i].flags & BA_META) != 0;
+        }
+        seen[recs[i].block] = 1;
+    }
+    free(seen);
+
+    printf("accesses: %ld (reads: %lu, writes: %lu)\n", n, n - nwrites,
+           nwrites);
+    printf("metadata accesses: %lu (%.1f%%)\n", nmeta, ratio(nmeta, n));
+    printf("distinct blocks: %u (metadata: %u)\n", ndistinct,
+           nmeta_distinct);
+
+    uint nsizes = argc > 2 ? argc - 2 : 0;
+    uint *sizes = malloc((nsizes + 32) * sizeof(uint));
+    for (uint i = 0; i < nsizes; i++) {
+        sizes[i] = strtoul(argv[i + 2], NULL, 10);
+        if (sizes[i] == 0) {
+            error("%s: %s: invalid cache size\n", progname, argv[i + 2]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (nsizes == 0)
+        for (uint s = 8; ; s *= 2) {
+            sizes[nsizes++] = s;
+            if (s >= ndistinct || nsizes == 32)
+                break;
+        }
+
+    printf("%12s %10s %10s %10s %10s\n", "cache_blocks", "lru_miss%",
+           "arc_miss%", "lru_meta%", "arc_meta%");
+    for (uint i = 0; i < nsizes; i++) {
+        struct result lr = { 0 }, ar = { 0 };
+        simulate(recs, n, nblocks, sizes[i], lru_access, &lr);
+        simulate(recs, n, nblocks, sizes[i], arc_access, &ar);
+        printf("%12u %10.2f %10.2f %10.2f %10.2f\n", sizes[i],
+               ratio(lr.misses, n), ratio(ar.misses, n),
+               ratio(lr.meta_misses, nmeta), ratio(ar.meta_misses, nmeta));
+    }
+    free(sizes);
+    free(recs);
+    return EXIT_SUCCESS;
+}
+
+/* For Emacs
+ * Local Variables: ***
+ * c-file-style: "gnu" ***
+ * c-basic-offset: 4 ***
+ * End: ***
+ */
@@ -3,11 +3,25 @@
  * Copyright (c) 2015-2019 Takuo Watanabe
  */
 
-/* usage: opfs img_file command [arg...]
+/* usage: opfs [--trace trace_file] [--block-trace blktrace_file] [--stats]
+ *             [--latency] [--readahead nblocks] [--balloc policy]
+ *             img_file command [arg...]
+ *     trace_file : file to which the libfs operations are appended
+ *                  (see replay)
+ *     blktrace_file : file to which the accesses to image blocks are
+ *                     appended (see opfs-cachesim)
+ *     --stats : prints the performance counters of libfs, the wall time,
+ *               page faults and maximum RSS to stderr after the command
+ *     --latency : prints the latency histograms of the libfs operations
+ *                 to stderr after the command
+ *     nblocks : # of blocks of subdirectories read ahead by tree walks
+ *               (default: 0, no readahead; see also OPFS_READAHEAD)
+ *     policy : block allocation policy: first-fit (default), next-fit,
+ *              best-fit or goal (see also OPFS_BALLOC)
  * command
  *     diskinfo
  *     info path
- *     ls path
+ *     ls [-lRSni] [-c cursor] [-m max] [path]
  *     get path
  *     put path
  *     rm path
@@ -16,8 +30,17 @@
  *     ln spath dpath
  *     mkdir path
  *     rmdir path
+ *     fallocate path size
+ *     index-dirs [path]
+ *     compact-dirs [-s] [path]
+ *     compact-inodes
+ *     convert format out_img_file
+ *     repack [-s] [--fit] out_img_file
+ *     fsck [--incremental] [state_file]
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -29,9 +52,14 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "libfs.h"
 
+// path of the image file
+static char *img_path;
+
 /*
  * Command implementations
  */
@@ -47,33 +75,43 @@ int do_diskinfo(img_t img, int argc, char *argv[]) {
     struct superblock *sb = SBLK(img);
 
     uint N = SBLK(img)->size;
-    uint Ni = sb->ninodes / IPB + 1;
-    uint Nm = N / (BSIZE * 8) + 1;
+    uint64 nbytes = (uint64)N * img->bsize;
+    uint Ni = sb->ninodes / img->ipb + 1;
+    uint Nm = N / img->bpb + 1;
     uint dstart = 2 + sb->nlog + Ni + Nm;
     uint Nd = SBLK(img)->nblocks;
 
-    printf("magic: %x\n", sb->magic);
-    printf("total blocks: %d (%d bytes)\n", N, N * BSIZE);
-    printf("log blocks: #%d-#%d (%d blocks)\n",
+    printf("format: %s\n", img->fmt->name);
+    if (img->fmt->magic)
+        printf("magic: %x\n", sb->magic);
+    printf("block size: %u\n", img->bsize);
+    printf("features:%s%s%s%s%s\n",
+           (img->features & FS_DINDIRECT) ? " dindirect" : "",
+           (img->features & FS_EXTENTS) ? " extents" : "",
+           (img->features & FS_INLINE) ? " inline" : "",
+           (img->features & FS_DIRINDEX) ? " dir-index" : "",
+           (img->features & FS_WIDEINUM) ? " wide-inum" : "");
+    printf("total blocks: %u (%lu bytes)\n", N, nbytes);
+    printf("log blocks: #%u-#%u (%u blocks)\n",
            sb->logstart, sb->logstart + sb->nlog - 1, sb->nlog);
-    printf("inode blocks: #%d-#%d (%d blocks, %d inodes)\n",
+    printf("inode blocks: #%u-#%u (%u blocks, %u inodes)\n",
            sb->inodestart, sb->inodestart + Ni - 1, Ni, sb->ninodes);
-    printf("bitmap blocks: #%d-#%d (%d blocks)\n",
+    printf("bitmap blocks: #%u-#%u (%u blocks)\n",
            sb->bmapstart, sb->bmapstart + Nm - 1, Nm);
-    printf("data blocks: #%d-#%d (%d blocks)\n",
+    printf("data blocks: #%u-#%u (%u blocks)\n",
            dstart, dstart + Nd - 1, Nd);
-    printf("maximum file size (bytes): %zu\n", MAXFILESIZE);
+    printf("maximum file size (bytes): %u\n", img->maxfilesize);
 
-    int nblocks = 0;
+    uint nblocks = 0;
     for (uint b = sb->bmapstart; b <= sb->bmapstart + Nm - 1; b++)
-        for (int i = 0; i < BSIZE; i++)
-            nblocks += bitcount(img[b][i]);
-    printf("# of used blocks: %d\n", nblocks);
+        for (uint i = 0; i < img->bsize; i++)
+            nblocks += bitcount(BLK(img, b)[i]);
+    printf("# of used blocks: %u\n", nblocks);
 
     int n_dirs = 0, n_files = 0, n_devs = 0;
     for (uint b = sb->inodestart; b <= sb->inodestart + Ni - 1; b++)
-        for (uint i = 0; i < IPB; i++)
-            switch (((inode_t)img[b])[i].type) {
+        for (uint i = 0; i < img->ipb; i++)
+            switch (((inode_t)BLK(img, b))[i].type) {
             case T_DIR:
                 n_dirs++;
                 break;
@@ -90,6 +128,14 @@ int do_diskinfo(img_t img, int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
+// prints a block number and counts it (used with iblocks)
+static int print_block(img_t img, uint b, void *arg) {
+    UNUSED(img);
+    printf(" %u", b);
+    (*(int *)arg)++;
+    return 0;
+}
+
 // info path
 int do_info(img_t img, int argc, char *argv[]) {
     if (argc != 1) {
@@ -106,59 +152,277 @@ int do_info(img_t img, int argc, char *argv[]) {
     printf("inode: %d\n", geti(img, ip));
     printf("type: %d (%s)\n", ip->type, typename(ip->type));
     printf("nlink: %d\n", ip->nlink);
-    printf("size: %d\n", ip->size);
-    if (ip->size > 0) {
-        printf("data blocks:");
-        int bcount = 0;
-        for (uint i = 0; i < NDIRECT && ip->addrs[i] != 0; i++, bcount++)
-            printf(" %d", ip->addrs[i]);
-        uint iaddr = ip->addrs[NDIRECT];
-        if (iaddr != 0) {
+    printf("size: %u\n", ip->size);
+    if (is_indexed(ip))
+        printf("indexed: yes\n");
+    if (is_inline(img, ip))
+        printf("inline data: %u bytes\n", ip->size);
+    else if (img->features & FS_EXTENTS) {
+        struct extent *e;
+        uint bcount = 0;
+        printf("extents:");
+        for (uint i = 0; (e = iextent(img, ip, i, false)) != NULL &&
+                 e->len != 0; i++, bcount += e->len)
+            printf(" %u-%u", e->start, e->start + e->len - 1);
+        printf("\n");
+        if (ip->addrs[NDIRECT] != 0) {
+            printf("extent block: %u\n", ip->addrs[NDIRECT]);
             bcount++;
-            printf(" %d", iaddr);
-            uint *iblock = (uint *)img[iaddr];
-            for (uint i = 0; i < BSIZE / sizeof(uint) && iblock[i] != 0;
-                 i++, bcount++)
-                printf(" %d", iblock[i]);
         }
+        printf("# of data blocks: %u\n", bcount);
+    }
+    // preallocated blocks may exist even if the file is empty
+    else if (ip->addrs[0] != 0) {
+        printf("data blocks:");
+        int bcount = 0;
+        iblocks(img, ip, print_block, &bcount);
         printf("\n");
         printf("# of data blocks: %d\n", bcount);
     }
     return EXIT_SUCCESS;
 }
 
-// ls path
+// options of ls
+struct ls_opts {
+    bool lflag;         // -l: long format
+    bool rflag;         // -R: lists subdirectories recursively
+    bool sflag;         // -S: sorts by size (largest first)
+    bool nflag;         // -n: sorts by name
+    bool iflag;         // -i: prints inode numbers
+    uint cursor;        // -c: where to resume the listing
+    uint max;           // -m: maximum # of entries listed (0: no limit)
+    uchar *visited;     // directories already listed (-R)
+};
+
+// a directory entry read by read_dir
+struct dir_ent {
+    uint off;           // offset of the entry in the directory
+    uint inum;
+    inode_t ip;
+    char name[DIRSIZ + 1];
+};
+
+static int dir_namecmp(const void *x, const void *y) {
+    return strncmp(((struct dir_ent *)x)->name, ((struct dir_ent *)y)->name,
+                   DIRSIZ);
+}
+
+static int ls_sizecmp(const void *x, const void *y) {
+    uint sx = ((struct dir_ent *)x)->ip->size;
+    uint sy = ((struct dir_ent *)y)->ip->size;
+    return sx != sy ? (sx < sy ? 1 : -1) : dir_namecmp(x, y);
+}
+
+// reads the entries of dp from offset off on, a block at a time, until
+// max entries (0: no limit) are read; returns a newly allocated array
+// the inode blocks of the entries are read ahead, and so are the blocks
+// of the subdirectories if walk is true (in a tree walk)
+static struct dir_ent *read_dir(img_t img, inode_t dp, uint off, uint max,
+                                bool walk, uint *np) {
+    uint n = 0, cap = (dp->size - off) / sizeof(struct dirent);
+    if (max > 0 && cap > max)
+        cap = max;
+    struct dir_ent *ents = malloc((cap + 1) * sizeof(struct dir_ent));
+    uchar *buf = malloc(img->bsize);
+    if (ents == NULL || buf == NULL) {
+        error("%s: out of memory\n", progname);
+        goto fail;
+    }
+    while (off < dp->size && n < cap) {
+        uint len = img->bsize - off % img->bsize;
+        if (len > dp->size - off)
+            len = dp->size - off;
+        dreadahead(img, dp, off, walk);
+        if (iread(img, dp, buf, len, off) != (int)len) {
+            error("%u: cannot read the directory\n", geti(img, dp));
+            goto fail;
+        }
+        for (uint k = 0; k + sizeof(struct dirent) <= len && n < cap;
+             k += sizeof(struct dirent)) {
+            struct dentry de;
+            dload(img, &de, buf + k);
+            if (de.inum == 0)
+                continue;
+            struct dir_ent *e = &ents[n++];
+            e->off = off + k;
+            e->inum = de.inum;
+            e->ip = iget(img, de.inum);
+            memcpy(e->name, de.name, DIRSIZ);
+            e->name[DIRSIZ] = 0;
+        }
+        off += len;
+    }
+    free(buf);
+    *np = n;
+    return ents;
+fail:
+    free(buf);
+    free(ents);
+    return NULL;
+}
+
+static char ls_typechar(inode_t ip) {
+    switch (ip->type) {
+    case T_DIR:
+        return 'd';
+    case T_FILE:
+        return '-';
+    case T_DEV:
+        return 'c';
+    }
+    return '?';
+}
+
+static void ls_print(struct ls_opts *o, const char *name, uint inum,
+                     inode_t ip) {
+    if (o->iflag)
+        printf("%u ", inum);
+    if (o->lflag)
+        printf("%c %3d %10u %s\n", ls_typechar(ip), ip->nlink, ip->size,
+               name);
+    else if (o->iflag)
+        printf("%s\n", name);
+    else
+        printf("%s %d %u %u\n", name, ip->type, inum, ip->size);
+}
+
+// lists the directory dp (path) and, with -R, its subdirectories
+static int ls_dir(img_t img, struct ls_opts *o, const char *path,
+                  inode_t dp) {
+    uint inum = geti(img, dp);
+    if (o->rflag) {
+        if (o->visited[inum]) {
+            error("ls: %s: directory loop\n", path);
+            return -1;
+        }
+        o->visited[inum] = 1;
+        printf("%s:\n", path);
+    }
+
+    // without sorting, only the entries to be listed are read and the
+    // cursor is an offset in the directory; otherwise, it is an index in
+    // the sorted list
+    bool sorted = o->sflag || o->nflag;
+    uint off = sorted ? 0 : o->cursor;
+    uint max = sorted || o->max == 0 ? 0 : o->max + 1;
+    if (off % sizeof(struct dirent) != 0 || off > dp->size) {
+        error("ls: %u: invalid cursor\n", o->cursor);
+        return -1;
+    }
+    uint n;
+    struct dir_ent *ents = read_dir(img, dp, off, max, o->rflag, &n);
+    if (ents == NULL)
+        return -1;
+    // entries referring to inodes out of range are reported and skipped
+    int r = 0;
+    uint k = 0;
+    for (uint i = 0; i < n; i++) {
+        if (ents[i].ip == NULL) {
+            error("ls: %s: invalid inode %u\n", ents[i].name, ents[i].inum);
+            r = -1;
+            continue;
+        }
+        ents[k++] = ents[i];
+    }
+    n = k;
+    if (sorted)
+        qsort(ents, n, sizeof(*ents), o->sflag ? ls_sizecmp : dir_namecmp);
+
+    uint first = sorted ? o->cursor : 0;
+    uint last = n;
+    if (first > n)
+        first = n;
+    if (o->max > 0 && last - first > o->max) {
+        last = first + o->max;
+        error("ls: more entries follow; continue with -c %u\n",
+              sorted ? last : ents[last].off);
+    }
+    for (uint i = first; i < last; i++)
+        ls_print(o, ents[i].name, ents[i].inum, ents[i].ip);
+
+    if (o->rflag) {
+        size_t plen = strlen(path);
+        char *sub = malloc(plen + DIRSIZ + 2);
+        for (uint i = first; i < last && sub != NULL; i++) {
+            if (ents[i].ip->type != T_DIR ||
+                strcmp(ents[i].name, ".") == 0 ||
+                strcmp(ents[i].name, "..") == 0)
+                continue;
+            sprintf(sub, "%s%s%s", path,
+                    plen > 0 && path[plen - 1] == '/' ? "" : "/",
+                    ents[i].name);
+            printf("\n");
+            if (ls_dir(img, o, sub, ents[i].ip) < 0)
+                r = -1;
+        }
+        free(sub);
+    }
+    free(ents);
+    return r;
+}
+
+// ls [-lRSni] [-c cursor] [-m max] [path]
 int do_ls(img_t img, int argc, char *argv[]) {
-    if (argc != 1) {
-        error("usage: %s img_file ls path\n", progname);
-        return EXIT_FAILURE;
+    struct ls_opts o = { 0 };
+    for (; argc > 0 && argv[0][0] == '-' && argv[0][1] != 0; argc--, argv++) {
+        if ((strcmp(argv[0], "-c") == 0 || strcmp(argv[0], "-m") == 0) &&
+            argc > 1) {
+            *(argv[0][1] == 'c' ? &o.cursor : &o.max) =
+                strtoul(argv[1], NULL, 10);
+            argc--;
+            argv++;
+            continue;
+        }
+        for (char *p = argv[0] + 1; *p != 0; p++) {
+            switch (*p) {
+            case 'l':
+                o.lflag = true;
+                break;
+            case 'R':
+                o.rflag = true;
+                break;
+            case 'S':
+                o.sflag = true;
+                break;
+            case 'n':
+                o.nflag = true;
+                break;
+            case 'i':
+                o.iflag = true;
+                break;
+            default:
+                goto usage;
+            }
+        }
     }
-    char *path = argv[0];
+    if (argc > 1 || (o.rflag && (o.cursor > 0 || o.max > 0)))
+        goto usage;
+    char *path = argc == 1 ? argv[0] : "/";
     inode_t ip = ilookup(img, root_inode, path);
     if (ip == NULL) {
         error("ls: %s: no such file or directory\n", path);
         return EXIT_FAILURE;
     }
-    if (ip->type == T_DIR) {
-        struct dirent de;
-        for (uint off = 0; off < ip->size; off += sizeof(de)) {
-            if (iread(img, ip, (uchar *)&de, sizeof(de), off) != sizeof(de)) {
-                error("ls: %s: read error\n", path);
-                return EXIT_FAILURE;
-            }
-            if (de.inum == 0)
-                continue;
-            char name[DIRSIZ + 1];
-            name[DIRSIZ] = 0;
-            strncpy(name, de.name, DIRSIZ);
-            inode_t p = iget(img, de.inum);
-            printf("%s %d %d %d\n", name, p->type, de.inum, p->size);
-        }
+    if (ip->type != T_DIR) {
+        ls_print(&o, path, geti(img, ip), ip);
+        return EXIT_SUCCESS;
     }
-    else
-        printf("%s %d %d %d\n", path, ip->type, geti(img, ip), ip->size);
 
-    return EXIT_SUCCESS;
+    // the listing is written in large chunks
+    static char outbuf[1 << 20];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+    if (o.rflag && (o.visited = calloc(SBLK(img)->ninodes, 1)) == NULL) {
+        error("ls: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    int r = ls_dir(img, &o, path, ip);
+    free(o.visited);
+    fflush(stdout);
+    return r == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+usage:
+    error("usage: %s img_file ls [-lRSni] [-c cursor] [-m max] [path]\n",
+          progname);
+    return EXIT_FAILURE;
 }
 
 // get path
@@ -218,18 +482,24 @@ int do_put(img_t img, int argc, char *argv[]) {
     }
     
     uchar buf[BUFSIZE];
-    for (uint off = 0; off < MAXFILESIZE; off += BUFSIZE) {
+    for (uint off = 0; ; ) {
         int n = read(0, buf, BUFSIZE);
         if (n < 0) {
             perror(NULL);
             return EXIT_FAILURE;
         }
+        if (n == 0)
+            break;
+        if (off + n > img->maxfilesize) {
+            error("put: %s: file too large (max %u bytes)\n", path,
+                  img->maxfilesize);
+            return EXIT_FAILURE;
+        }
         if (iwrite(img, ip, buf, n, off) != n) {
             error("put: %s: write error\n", path);
             return EXIT_FAILURE;
         }
-        if (n < BUFSIZE)
-            break;
+        off += n;
     }
     return EXIT_SUCCESS;
 }
@@ -549,40 +819,1130 @@ int do_rmdir(img_t img, int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
+// fallocate path size
+int do_fallocate(img_t img, int argc, char *argv[]) {
+    if (argc != 2) {
+        error("usage: %s img_file fallocate path size\n", progname);
+        return EXIT_FAILURE;
+    }
+    char *path = argv[0];
+    uint size = strtoul(argv[1], NULL, 10);
+
+    inode_t ip = ilookup(img, root_inode, path);
+    if (ip == NULL) {
+        ip = icreat(img, root_inode, path, T_FILE, NULL);
+        if (ip == NULL) {
+            error("fallocate: %s: cannot create\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+    if (ip->type == T_DEV) {
+        error("fallocate: %s: device\n", path);
+        return EXIT_FAILURE;
+    }
+    if (iprealloc(img, ip, size) < 0) {
+        error("fallocate: %s: cannot allocate %u bytes\n", path, size);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// applies f to the directories in the tree rooted at dp (post-order);
+// returns the number of directories for which f failed
+static int walk_dirs(img_t img, inode_t dp,
+                     int (*f)(img_t, inode_t, void *), void *arg) {
+    int nerr = 0;
+    struct dentry de;
+    for (uint off = 0; off < dp->size; off += sizeof(struct dirent)) {
+        if (off % img->bsize == 0)
+            dreadahead(img, dp, off, true);
+        if (dread(img, dp, &de, off) < 0)
+            return nerr + 1;
+        if (de.inum == 0 || strncmp(de.name, ".", DIRSIZ) == 0 ||
+            strncmp(de.name, "..", DIRSIZ) == 0)
+            continue;
+        inode_t ip = iget(img, de.inum);
+        if (ip != NULL && ip->type == T_DIR)
+            nerr += walk_dirs(img, ip, f, arg);
+    }
+    if (f(img, dp, arg) < 0)
+        nerr++;
+    return nerr;
+}
+
+// readahead of the directories visited in the order of their inode
+// numbers
+struct dir_readahead {
+    uint next;      // inode whose blocks are advised next
+    uint ahead;     // # of blocks advised ahead of the directory visited
+};
+
+// advises the blocks of the directories from inode inum, which is about
+// to be visited, on up to readahead_window blocks ahead
+static void readahead_dirs(img_t img, struct dir_readahead *ra, uint inum) {
+    if (readahead_window == 0)
+        return;
+    if (ra->next <= inum) {
+        ra->next = inum;
+        ra->ahead = 0;
+    }
+    else {
+        uint n = (iget(img, inum)->size + img->bsize - 1) >> img->bshift;
+        ra->ahead -= ra->ahead < n ? ra->ahead : n;
+    }
+    while (ra->next < SBLK(img)->ninodes && ra->ahead < readahead_window)
+        ra->ahead += ireadahead(img, iget(img, ra->next++),
+                                readahead_window - ra->ahead);
+}
+
+// finds the directory to be processed by index-dirs or compact-dirs
+static inode_t dir_arg(img_t img, char *cmd, int argc, char *argv[]) {
+    char *path = argc == 1 ? argv[0] : "/";
+    inode_t dp = ilookup(img, root_inode, path);
+    if (dp == NULL) {
+        error("%s: %s: no such directory\n", cmd, path);
+        return NULL;
+    }
+    if (dp->type != T_DIR) {
+        error("%s: %s: not a directory\n", cmd, path);
+        return NULL;
+    }
+    return dp;
+}
+
+static int index_dir(img_t img, inode_t dp, void *arg) {
+    UNUSED(arg);
+    if (dp->size > img->bsize && !is_indexed(dp) && dindex(img, dp) != 0) {
+        error("index-dirs: %u: cannot index\n", geti(img, dp));
+        return -1;
+    }
+    return 0;
+}
+
+// index-dirs [path]
+int do_index_dirs(img_t img, int argc, char *argv[]) {
+    if (argc > 1) {
+        error("usage: %s img_file index-dirs [path]\n", progname);
+        return EXIT_FAILURE;
+    }
+    inode_t dp = dir_arg(img, "index-dirs", argc, argv);
+    if (dp == NULL)
+        return EXIT_FAILURE;
+    // directories created or grown later are indexed as well
+    img->features |= FS_DIRINDEX;
+    SBLK(img)->features = img->features;
+    return walk_dirs(img, dp, index_dir, NULL) == 0 ?
+        EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int compact_dir(img_t img, inode_t dp, void *arg) {
+    if (dcompact(img, dp, *(bool *)arg) != 0) {
+        error("compact-dirs: %u: cannot compact\n", geti(img, dp));
+        return -1;
+    }
+    return 0;
+}
+
+// compact-dirs [-s] [path]
+int do_compact_dirs(img_t img, int argc, char *argv[]) {
+    bool sort = argc > 0 && strcmp(argv[0], "-s") == 0;
+    if (sort) {
+        argc--;
+        argv++;
+    }
+    if (argc > 1) {
+        error("usage: %s img_file compact-dirs [-s] [path]\n", progname);
+        return EXIT_FAILURE;
+    }
+    inode_t dp = dir_arg(img, "compact-dirs", argc, argv);
+    if (dp == NULL)
+        return EXIT_FAILURE;
+    return walk_dirs(img, dp, compact_dir, &sort) == 0 ?
+        EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// replaces the inode numbers in the entries of the directory dp by
+// inum_map; returns the number of entries referring to free inodes,
+// which are removed
+static uint renumber_dents(img_t img, inode_t dp, const uint *inum_map,
+                           uchar *buf) {
+    uint nbad = 0;
+    for (uint off = 0; off < dp->size; off += img->bsize) {
+        uint len = dp->size - off < img->bsize ? dp->size - off : img->bsize;
+        if (iread(img, dp, buf, len, off) != (int)len)
+            fatal("compact-inodes: %u: read error\n", geti(img, dp));
+        bool dirty = false;
+        for (uint k = 0; k + sizeof(struct dirent) <= len;
+             k += sizeof(struct dirent)) {
+            struct dentry de;
+            dload(img, &de, buf + k);
+            if (de.inum == 0)
+                continue;   // also the index records of indexed directories
+            uint inum = de.inum < SBLK(img)->ninodes ? inum_map[de.inum] : 0;
+            if (inum == 0) {
+                error("compact-inodes: %u: %.*s: removed (inode %u is free)\n",
+                      geti(img, dp), DIRSIZ, de.name, de.inum);
+                nbad++;
+            }
+            de.inum = inum;
+            dstore(img, buf + k, &de);
+            dirty = true;
+        }
+        if (dirty && iwrite(img, dp, buf, len, off) != (int)len)
+            fatal("compact-inodes: %u: write error\n", geti(img, dp));
+    }
+    return nbad;
+}
+
+// compact-inodes
+int do_compact_inodes(img_t img, int argc, char *argv[]) {
+    UNUSED(argv);
+    if (argc != 0) {
+        error("usage: %s img_file compact-inodes\n", progname);
+        return EXIT_FAILURE;
+    }
+    // the live inodes keep their order and the root stays first, so that
+    // no inode moves to a higher number
+    const uint N = SBLK(img)->ninodes;
+    uint *inum_map = calloc(N, sizeof(uint));
+    uchar *buf = malloc(img->bsize);
+    if (inum_map == NULL || buf == NULL) {
+        error("compact-inodes: out of memory\n");
+        free(inum_map);
+        free(buf);
+        return EXIT_FAILURE;
+    }
+    uint n = root_inode_number;
+    inum_map[root_inode_number] = root_inode_number;
+    for (uint i = 1; i < N; i++)
+        if (i != root_inode_number && iget(img, i)->type != 0)
+            inum_map[i] = ++n;
+
+    // the entries of every directory are rewritten in one pass over the
+    // inode table before the inodes are moved
+    uint nbad = 0;
+    struct dir_readahead ra = { 0, 0 };
+    for (uint i = 1; i < N; i++)
+        if (iget(img, i)->type == T_DIR) {
+            readahead_dirs(img, &ra, i);
+            nbad += renumber_dents(img, iget(img, i), inum_map, buf);
+        }
+    uint nmoved = 0;
+    for (uint i = 1; i < N; i++)
+        if (inum_map[i] != 0 && inum_map[i] != i) {
+            *iget(img, inum_map[i]) = *iget(img, i);
+            memset(iget(img, i), 0, sizeof(struct dinode));
+            nmoved++;
+        }
+    img->ihint = 0;
+    img->bcache_ip = NULL;
+    printf("compact-inodes: %u inodes renumbered, highest inode: %u\n",
+           nmoved, n);
+    free(inum_map);
+    free(buf);
+    return nbad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// copies the data of the file sip in simg to dip in dimg
+static int copy_data(img_t dimg, inode_t dip, img_t simg, inode_t sip) {
+    uchar buf[BUFSIZE];
+    for (uint off = 0; off < sip->size; off += BUFSIZE) {
+        int n = iread(simg, sip, buf, BUFSIZE, off);
+        if (n < 0 || iwrite(dimg, dip, buf, n, off) != n)
+            return -1;
+    }
+    return 0;
+}
+
+// copies the entries of the directory sdp in simg to ddp in dimg
+// recursively; inum_map maps the inode numbers of the files already
+// copied to those in dimg so that hard links are preserved.  Returns the
+// number of files that could not be copied.
+static int copy_tree(img_t dimg, inode_t ddp, img_t simg, inode_t sdp,
+                     uint *inum_map) {
+    int nerr = 0;
+    struct dentry de;
+    for (uint off = 0; off < sdp->size; off += sizeof(struct dirent)) {
+        if (off % simg->bsize == 0)
+            dreadahead(simg, sdp, off, true);
+        if (dread(simg, sdp, &de, off) < 0)
+            return nerr + 1;
+        if (de.inum == 0 || strncmp(de.name, ".", DIRSIZ) == 0 ||
+            strncmp(de.name, "..", DIRSIZ) == 0)
+            continue;
+        char name[DIRSIZ + 1];
+        name[DIRSIZ] = 0;
+        strncpy(name, de.name, DIRSIZ);
+        inode_t sip = iget(simg, de.inum);
+        if (sip == NULL || sip->type == 0) {
+            error("%s: invalid inode %u\n", name, de.inum);
+            nerr++;
+            continue;
+        }
+        if (inum_map[de.inum] != 0 && sip->type != T_DIR) {
+            if (daddent(dimg, ddp, name, iget(dimg, inum_map[de.inum])) < 0)
+                nerr++;
+            continue;
+        }
+        inode_t dip = icreat(dimg, ddp, name, sip->type, NULL);
+        if (dip == NULL) {
+            error("%s: cannot create\n", name);
+            nerr++;
+            continue;
+        }
+        inum_map[de.inum] = geti(dimg, dip);
+        if (sip->type == T_DIR)
+            nerr += copy_tree(dimg, dip, simg, sip, inum_map);
+        else if (sip->type == T_DEV) {
+            dip->major = sip->major;
+            dip->minor = sip->minor;
+        }
+        else if (copy_data(dimg, dip, simg, sip) < 0) {
+            error("%s: cannot copy\n", name);
+            nerr++;
+        }
+    }
+    return nerr;
+}
+
+// convert format out_img_file
+int do_convert(img_t img, int argc, char *argv[]) {
+    if (argc != 2) {
+        error("usage: %s img_file convert format out_img_file\n", progname);
+        return EXIT_FAILURE;
+    }
+    const struct fsformat *fmt = findformat(argv[0]);
+    char *file = argv[1];
+    if (fmt == NULL) {
+        error("convert: %s: unknown format\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // the new image has the same size in bytes, the same number of inodes
+    // and log blocks, and the same features as the original one
+    struct superblock *sb = SBLK(img);
+    uint64 nbytes = (uint64)sb->size * img->bsize;
+    uint size = nbytes / fmt->bsize;
+    int fd;
+    uchar *base = createimg(file, (uint64)size * fmt->bsize, &fd);
+    if (base == NULL)
+        return EXIT_FAILURE;
+    int status = EXIT_FAILURE;
+    struct img dimg_buf;
+    img_t dimg = &dimg_buf;
+    uint *inum_map = calloc(sb->ninodes, sizeof(uint));
+    if (inum_map == NULL)
+        goto bye;
+    if (initimg(dimg, fmt, base, (size_t)size * fmt->bsize, fmt->bsize,
+                img->features) < 0 ||
+        mkfs(dimg, size, sb->ninodes, sb->nlog) < 0) {
+        error("convert: %s: cannot make a file system\n", file);
+        goto bye;
+    }
+    if (copy_tree(dimg, iget(dimg, root_inode_number), img, root_inode,
+                  inum_map) == 0)
+        status = EXIT_SUCCESS;
+bye:
+    free(inum_map);
+    munmap(base, (size_t)size * fmt->bsize);
+    close(fd);
+    return status;
+}
+
+/*
+ * Repacking
+ *
+ * The tree is copied into a new image breadth first, so that the inodes
+ * are numbered in that order.  When a directory is reached, its blocks
+ * are reserved at once, its entries are added without holes (sorted by
+ * name with -s) and the data of each of its files is laid out in a
+ * single run just after them.  The "." and ".." of a directory are added
+ * only when it is reached, so that its first block is not separated from
+ * the rest.
+ */
+
+struct repack {
+    img_t dimg, simg;
+    bool sort;
+    bool data;          // copies the data (otherwise only reserves blocks)
+    uint *inum_map;     // inode numbers in simg -> those in dimg
+    uint *queue;        // directories to be copied: pairs of the inode
+    uint head, tail;    // number in simg and that of the parent in dimg
+};
+
+// copies the entries of the directory sdp to ddp, whose parent is dpp
+static int repack_dir(struct repack *r, inode_t sdp, inode_t ddp,
+                      inode_t dpp) {
+    img_t dimg = r->dimg, simg = r->simg;
+    uint n;
+    struct dir_ent *ents = read_dir(simg, sdp, 0, 0, true, &n);
+    if (ents == NULL)
+        return 1;
+    uint nent = 2;
+    for (uint i = 0; i < n; i++)
+        nent += strncmp(ents[i].name, ".", DIRSIZ) != 0 &&
+            strncmp(ents[i].name, "..", DIRSIZ) != 0;
+    // an indexed directory larger than a block is laid out by libfs
+    uint size = nent * sizeof(struct dirent);
+    if (!((dimg->features & FS_DIRINDEX) && size > dimg->bsize) &&
+        iprealloc(dimg, ddp, size) < 0) {
+        error("repack: %u: cannot allocate %u bytes\n", geti(dimg, ddp), size);
+        free(ents);
+        return 1;
+    }
+    if (r->sort)
+        qsort(ents, n, sizeof(*ents), dir_namecmp);
+
+    int nerr = 0;
+    if (daddent(dimg, ddp, ".", ddp) < 0 || daddent(dimg, ddp, "..", dpp) < 0)
+        nerr++;
+    for (uint i = 0; i < n; i++) {
+        struct dir_ent *e = &ents[i];
+        if (strncmp(e->name, ".", DIRSIZ) == 0 ||
+            strncmp(e->name, "..", DIRSIZ) == 0)
+            continue;
+        inode_t sip = e->ip;
+        if (sip == NULL || sip->type == 0) {
+            error("repack: %s: invalid inode %u\n", e->name, e->inum);
+            nerr++;
+            continue;
+        }
+        if (r->inum_map[e->inum] != 0 && sip->type != T_DIR) {
+            if (daddent(dimg, ddp, e->name,
+                        iget(dimg, r->inum_map[e->inum])) < 0)
+                nerr++;
+            continue;
+        }
+        if (r->inum_map[e->inum] != 0) {
+            error("repack: %s: directory linked twice\n", e->name);
+            nerr++;
+            continue;
+        }
+        inode_t dip = ialloc(dimg, sip->type);
+        r->inum_map[e->inum] = geti(dimg, dip);
+        if (daddent(dimg, ddp, e->name, dip) < 0) {
+            error("repack: %s: cannot create\n", e->name);
+            nerr++;
+            continue;
+        }
+        if (sip->type == T_DIR) {
+            r->queue[r->tail++] = e->inum;
+            r->queue[r->tail++] = geti(dimg, ddp);
+        }
+        else if (sip->type == T_DEV) {
+            dip->major = sip->major;
+            dip->minor = sip->minor;
+        }
+        else if (iprealloc(dimg, dip, sip->size) < 0 ||
+                 (r->data && copy_data(dimg, dip, simg, sip) < 0)) {
+            error("repack: %s: cannot copy\n", e->name);
+            nerr++;
+        }
+    }
+    free(ents);
+    return nerr;
+}
+
+// copies the whole tree of simg into dimg, which has just been made by
+// mkfs; returns the number of files that could not be copied
+static int repack_tree(img_t dimg, img_t simg, bool sort, bool data) {
+    uint ninodes = SBLK(simg)->ninodes;
+    struct repack r = { dimg, simg, sort, data, NULL, NULL, 0, 0 };
+    r.inum_map = calloc(ninodes, sizeof(uint));
+    r.queue = malloc(2 * ninodes * sizeof(uint));
+    if (r.inum_map == NULL || r.queue == NULL) {
+        error("repack: out of memory\n");
+        free(r.inum_map);
+        free(r.queue);
+        return 1;
+    }
+
+    // the root made by mkfs is emptied so that its blocks are reserved
+    // together as those of the other directories
+    inode_t drp = iget(dimg, root_inode_number);
+    itruncate(dimg, drp, 0);
+    drp->nlink = 0;
+    r.inum_map[root_inode_number] = root_inode_number;
+    r.queue[r.tail++] = root_inode_number;
+    r.queue[r.tail++] = root_inode_number;
+    int nerr = 0;
+    while (r.head < r.tail) {
+        uint sinum = r.queue[r.head++];
+        uint dparent = r.queue[r.head++];
+        nerr += repack_dir(&r, iget(simg, sinum),
+                           iget(dimg, r.inum_map[sinum]),
+                           iget(dimg, dparent));
+    }
+    free(r.inum_map);
+    free(r.queue);
+    return nerr;
+}
+
+// computes the # of blocks and inodes of the smallest image into which
+// img can be repacked, by repacking it into a scratch image in memory
+// without the data (the blocks of the files are only reserved)
+static int repack_fit(img_t img, bool sort, uint *sizep, uint *ninodesp) {
+    struct superblock *sb = SBLK(img);
+    // allocated lazily; the data blocks are only reserved in the bitmap,
+    // never zeroed, so only the blocks written (metadata) take memory
+    uchar *base = calloc(sb->size, img->bsize);
+    if (base == NULL) {
+        error("repack: out of memory\n");
+        return -1;
+    }
+    struct img simg_buf;
+    img_t simg = &simg_buf;
+    if (initimg(simg, img->fmt, base, (size_t)sb->size * img->bsize,
+                img->bsize, img->features) < 0) {
+        free(base);
+        return -1;
+    }
+    simg->bclean = true;
+    int r = -1;
+    if (mkfs(simg, sb->size, sb->ninodes, sb->nlog) == 0 &&
+        repack_tree(simg, img, sort, false) == 0) {
+        struct superblock *ssb = SBLK(simg);
+        uint nused = 0, niused = 1;     // inode 0 is never used
+        for (uint b = 0; b < ssb->size; b += img->bpb)
+            for (uint i = 0; i < img->bsize; i++)
+                nused += bitcount(BLK(simg, BBLK(simg, b))[i]);
+        nused -= ssb->size - ssb->nblocks;
+        for (uint i = 1; i < ssb->ninodes; i++)
+            niused += iget(simg, i)->type != 0;
+        *ninodesp = niused;
+        *sizep = fssize(simg, nused, niused, sb->nlog);
+        r = 0;
+    }
+    free(base);
+    return r;
+}
+
+// repack [-s] [--fit] out_img_file
+int do_repack(img_t img, int argc, char *argv[]) {
+    bool sort = false, fit = false;
+    char *file = NULL;
+    for (; argc > 0; argc--, argv++) {
+        if (strcmp(argv[0], "-s") == 0)
+            sort = true;
+        else if (strcmp(argv[0], "--fit") == 0)
+            fit = true;
+        else if (file == NULL)
+            file = argv[0];
+        else
+            break;
+    }
+    if (file == NULL || argc > 0) {
+        error("usage: %s img_file repack [-s] [--fit] out_img_file\n",
+              progname);
+        return EXIT_FAILURE;
+    }
+
+    // the new image has the same geometry and features as the original
+    // one unless --fit is given
+    struct superblock *sb = SBLK(img);
+    uint size = sb->size, ninodes = sb->ninodes;
+    if (fit && repack_fit(img, sort, &size, &ninodes) < 0)
+        return EXIT_FAILURE;
+    int fd;
+    uchar *base = createimg(file, (uint64)size * img->bsize, &fd);
+    if (base == NULL)
+        return EXIT_FAILURE;
+    int status = EXIT_FAILURE;
+    struct img dimg_buf;
+    img_t dimg = &dimg_buf;
+    if (initimg(dimg, img->fmt, base, (size_t)size * img->bsize, img->bsize,
+                img->features) < 0 ||
+        mkfs(dimg, size, ninodes, sb->nlog) < 0) {
+        error("repack: %s: cannot make a file system\n", file);
+        goto bye;
+    }
+    if (repack_tree(dimg, img, sort, true) == 0)
+        status = EXIT_SUCCESS;
+bye:
+    munmap(base, (size_t)size * img->bsize);
+    close(fd);
+    return status;
+}
+
+/*
+ * Consistency check (fsck)
+ *
+ * A successful check leaves its verification state in a file so that a
+ * later incremental check only has to look at what has changed: the hash
+ * of every inode and of every metadata block in the data region
+ * (directory, indirect and extent blocks), the owner of every block, the
+ * references to every inode, the entries of every directory and a copy
+ * of the bitmap.  Metadata is hashed in full on every run, but the
+ * directories, block lists and bitmap bits are rechecked only for the
+ * inodes whose hashes changed and for the inodes they refer to, and the
+ * state is saved again only if something changed.  The data blocks are
+ * never read, but the cost still grows with the amount of metadata.
+ */
+
+#define FSCK_MAGIC 0x31736b6366706fUL  // "opfcks1"
+
+struct fsck_state {
+    uint size, ninodes, bsize, features;  // geometry of the image
+    uint64 *ihash;      // hash of each inode
+    uint *refs;         // # of entries other than "." referring to each inode
+    uint *parent;       // directory with an entry (not "..") for each dir
+    uint *dotdot;       // ".." of each directory
+    uint **dents;       // inode numbers in the entries other than "." of
+    uint *ndents;       // each directory, ".." first
+    uint *owner;        // inode owning each block
+    uint64 *bhash;      // hash of each metadata block in the data region
+    uchar *bitmap;      // copy of the bitmap
+    // work areas
+    uint *meta;         // metadata blocks with a hash when loaded
+    uint nmeta;
+    uchar *mark;        // inodes to be rechecked
+    uint *touched;      // blocks whose bitmap bits are to be rechecked
+    uint ntouched;
+    bool changed;       // the state differs from the one loaded
+    uint nerrors;
+};
+
+static uint64 hash_bytes(const uchar *p, uint n) {
+    uint64 h = 0xcbf29ce484222325UL;
+    for (uint i = 0; i < n; i += sizeof(uint64)) {
+        uint64 w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3UL;
+        h ^= h >> 29;
+    }
+    return h | 1;   // 0 means "not a metadata block"
+}
+
+static uint bitmap_bytes(uint size) {
+    return size / 8 + 1;
+}
+
+static void fsck_free(struct fsck_state *st) {
+    if (st->dents != NULL)
+        for (uint i = 0; i < st->ninodes; i++)
+            free(st->dents[i]);
+    free(st->ihash);
+    free(st->refs);
+    free(st->parent);
+    free(st->dotdot);
+    free(st->dents);
+    free(st->ndents);
+    free(st->owner);
+    free(st->bhash);
+    free(st->bitmap);
+    free(st->meta);
+    free(st->mark);
+    free(st->touched);
+}
+
+static int fsck_alloc(struct fsck_state *st, uint size, uint ninodes) {
+    st->size = size;
+    st->ninodes = ninodes;
+    st->ihash = calloc(ninodes, sizeof(uint64));
+    st->refs = calloc(ninodes, sizeof(uint));
+    st->parent = calloc(ninodes, sizeof(uint));
+    st->dotdot = calloc(ninodes, sizeof(uint));
+    st->dents = calloc(ninodes, sizeof(uint *));
+    st->ndents = calloc(ninodes, sizeof(uint));
+    st->owner = calloc(size, sizeof(uint));
+    st->bhash = calloc(size, sizeof(uint64));
+    st->bitmap = calloc(bitmap_bytes(size), 1);
+    st->meta = calloc(size, sizeof(uint));
+    st->mark = calloc(ninodes, 1);
+    // a block may be released and claimed again by an incremental check
+    st->touched = calloc(size, 2 * sizeof(uint));
+    if (st->ihash == NULL || st->refs == NULL || st->parent == NULL ||
+        st->dotdot == NULL || st->dents == NULL || st->ndents == NULL ||
+        st->owner == NULL || st->bhash == NULL || st->bitmap == NULL ||
+        st->meta == NULL || st->mark == NULL || st->touched == NULL) {
+        error("fsck: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+#define fsck_error(st, ...) ((st)->nerrors++, error("fsck: " __VA_ARGS__))
+
+static void copy_bitmap(img_t img, uchar *dst) {
+    struct superblock *sb = SBLK(img);
+    uint n = bitmap_bytes(sb->size);
+    for (uint k = 0; k < n; k += img->bsize) {
+        uint m = n - k < img->bsize ? n - k : img->bsize;
+        memcpy(dst + k, BLK(img, sb->bmapstart + k / img->bsize), m);
+    }
+}
+
+static bool bitmap_bit(const uchar *bitmap, uint b) {
+    return (bitmap[b / 8] >> (b % 8)) & 1;
+}
+
+struct fsck_blocks {
+    struct fsck_state *st;
+    uint inum;
+    bool meta;          // all the blocks are metadata (directories)
+};
+
+// claims a block of an inode (used with iblocks)
+static int claim_block(img_t img, uint b, void *arg) {
+    struct fsck_blocks *fb = arg;
+    struct fsck_state *st = fb->st;
+    if (!valid_data_block(img, b)) {
+        fsck_error(st, "%u: invalid block %u\n", fb->inum, b);
+        return 1;   // the rest of the block list cannot be trusted
+    }
+    if (st->owner[b] != 0) {
+        fsck_error(st, "%u: block %u is also used by %u\n", fb->inum, b,
+                   st->owner[b]);
+        return 0;
+    }
+    st->owner[b] = fb->inum;
+    st->touched[st->ntouched++] = b;
+    if (fb->meta)
+        st->bhash[b] = hash_bytes(BLK(img, b), img->bsize);
+    return 0;
+}
+
+// records the hash of a metadata block of a file
+static void claim_meta(img_t img, struct fsck_state *st, uint b) {
+    if (b != 0 && valid_data_block(img, b) && st->owner[b] != 0)
+        st->bhash[b] = hash_bytes(BLK(img, b), img->bsize);
+}
+
+// claims the blocks of inode inum and hashes its metadata blocks
+static void check_blocks(img_t img, struct fsck_state *st, uint inum) {
+    inode_t ip = iget(img, inum);
+    if (ip->type == T_DEV || is_inline(img, ip))
+        return;
+    struct fsck_blocks fb = { st, inum, ip->type == T_DIR };
+    iblocks(img, ip, claim_block, &fb);
+    if (ip->type == T_DIR)
+        return;
+    if (img->features & FS_EXTENTS) {
+        claim_meta(img, st, ip->addrs[NDIRECT]);
+        return;
+    }
+    claim_meta(img, st, ip->addrs[img->ndirect]);
+    uint d = (img->features & FS_DINDIRECT) ? ip->addrs[img->ndirect + 1] : 0;
+    if (d != 0 && valid_data_block(img, d)) {
+        claim_meta(img, st, d);
+        uint *dblock = (uint *)BLK(img, d);
+        for (uint i = 0; i < img->nindirect; i++)
+            claim_meta(img, st, dblock[i]);
+    }
+}
+
+// reads the entries of directory inum and adds the references
+static void add_dents(img_t img, struct fsck_state *st, uint inum) {
+    inode_t dp = iget(img, inum);
+    uint n = dp->size / sizeof(struct dirent);
+    uint *list = malloc((n + 1) * sizeof(uint));
+    uint k = 1;     // list[0] is ".."
+    bool dot = false, dotdot = false;
+    list[0] = 0;
+    struct dentry de;
+    for (uint off = 0; off < dp->size; off += sizeof(struct dirent)) {
+        if (dread(img, dp, &de, off) < 0) {
+            fsck_error(st, "%u: cannot read the directory\n", inum);
+            break;
+        }
+        if (de.inum == 0)
+            continue;
+        if (de.inum >= st->ninodes) {
+            fsck_error(st, "%u: %.*s: invalid inode number %u\n", inum,
+                       DIRSIZ, de.name, de.inum);
+            continue;
+        }
+        st->mark[de.inum] = 1;
+        if (strncmp(de.name, ".", DIRSIZ) == 0) {
+            if (de.inum != inum)
+                fsck_error(st, "%u: \".\" refers to %u\n", inum, de.inum);
+            dot = true;
+            continue;
+        }
+        st->refs[de.inum]++;
+        if (strncmp(de.name, "..", DIRSIZ) == 0) {
+            list[0] = st->dotdot[inum] = de.inum;
+            dotdot = true;
+            continue;
+        }
+        list[k++] = de.inum;
+        if (iget(img, de.inum)->type == T_DIR) {
+            if (st->parent[de.inum] != 0)
+                fsck_error(st, "%u: directory %u is also linked from %u\n",
+                           inum, de.inum, st->parent[de.inum]);
+            st->parent[de.inum] = inum;
+        }
+    }
+    if (!dot)
+        fsck_error(st, "%u: no \".\"\n", inum);
+    if (!dotdot)
+        fsck_error(st, "%u: no \"..\"\n", inum);
+    st->dents[inum] = list;
+    st->ndents[inum] = k;
+}
+
+// removes the references recorded for the entries of directory inum
+static void remove_dents(img_t img, struct fsck_state *st, uint inum) {
+    UNUSED(img);
+    uint *list = st->dents[inum];
+    if (list == NULL)
+        return;
+    for (uint k = 0; k < st->ndents[inum]; k++) {
+        uint x = list[k];
+        if (x == 0)
+            continue;
+        st->mark[x] = 1;
+        st->refs[x]--;
+        if (k > 0 && st->parent[x] == inum)
+            st->parent[x] = 0;
+    }
+    free(list);
+    st->dents[inum] = NULL;
+    st->ndents[inum] = 0;
+    st->dotdot[inum] = 0;
+}
+
+// checks the type, links and parent of inode inum
+static void check_inode(img_t img, struct fsck_state *st, uint inum) {
+    inode_t ip = iget(img, inum);
+    if (ip->type == 0) {
+        if (st->refs[inum] != 0)
+            fsck_error(st, "%u: free inode referred to %u times\n", inum,
+                       st->refs[inum]);
+        return;
+    }
+    if (ip->type != T_DIR && ip->type != T_FILE && ip->type != T_DEV) {
+        fsck_error(st, "%u: invalid type %d\n", inum, ip->type);
+        return;
+    }
+    if (inum == root_inode_number && ip->type != T_DIR)
+        fsck_error(st, "%u: root is not a directory\n", inum);
+    if (st->refs[inum] == 0)
+        fsck_error(st, "%u: unreferenced inode\n", inum);
+    // directories made by xv6 itself have nlink 1
+    if ((uint)ip->nlink != st->refs[inum] && !(ip->type == T_DIR && ip->nlink == 1))
+        fsck_error(st, "%u: nlink is %u, but referred to %u times\n", inum,
+                   ip->nlink, st->refs[inum]);
+    if (ip->type == T_DIR) {
+        uint parent = inum == root_inode_number ? inum : st->parent[inum];
+        if (st->dotdot[inum] != parent)
+            fsck_error(st, "%u: \"..\" refers to %u instead of %u\n", inum,
+                       st->dotdot[inum], parent);
+    }
+}
+
+// checks the bitmap bit of block b
+static void check_bit(img_t img, struct fsck_state *st, uint b) {
+    struct superblock *sb = SBLK(img);
+    bool used = !valid_data_block(img, b) || st->owner[b] != 0;
+    bool bit = bitmap_bit(BLK(img, sb->bmapstart + b / img->bpb),
+                          b % img->bpb);
+    if (used && !bit)
+        fsck_error(st, "block %u is used but marked free\n", b);
+    else if (!used && bit)
+        fsck_error(st, "block %u is marked used but not used\n", b);
+}
+
+static void fsck_full(img_t img, struct fsck_state *st) {
+    struct superblock *sb = SBLK(img);
+    for (uint i = 1; i < sb->ninodes; i++) {
+        inode_t ip = iget(img, i);
+        st->ihash[i] = hash_bytes((uchar *)ip, sizeof(struct dinode));
+        if (ip->type != 0)
+            check_blocks(img, st, i);
+    }
+    struct dir_readahead ra = { 0, 0 };
+    for (uint i = 1; i < sb->ninodes; i++)
+        if (iget(img, i)->type == T_DIR) {
+            readahead_dirs(img, &ra, i);
+            add_dents(img, st, i);
+        }
+    for (uint i = 1; i < sb->ninodes; i++)
+        check_inode(img, st, i);
+    for (uint b = 0; b < sb->size; b++)
+        check_bit(img, st, b);
+    copy_bitmap(img, st->bitmap);
+}
+
+// returns the number of inodes rechecked
+static uint fsck_incremental(img_t img, struct fsck_state *st) {
+    struct superblock *sb = SBLK(img);
+    uchar *dirty = calloc(sb->ninodes, 1);
+    uint ndirty = 0;
+    for (uint i = 1; i < sb->ninodes; i++) {
+        uint64 h = hash_bytes((uchar *)iget(img, i), sizeof(struct dinode));
+        if (h != st->ihash[i]) {
+            st->ihash[i] = h;
+            ndirty += !dirty[i];
+            dirty[i] = 1;
+        }
+    }
+    for (uint k = 0; k < st->nmeta; k++) {
+        uint b = st->meta[k];
+        if (hash_bytes(BLK(img, b), img->bsize) != st->bhash[b]) {
+            ndirty += !dirty[st->owner[b]];
+            dirty[st->owner[b]] = 1;
+        }
+    }
+
+    // the blocks of the dirty inodes are claimed again
+    if (ndirty > 0)
+        for (uint b = 0; b < sb->size; b++)
+            if (st->owner[b] != 0 && dirty[st->owner[b]]) {
+                st->owner[b] = 0;
+                st->bhash[b] = 0;
+                st->touched[st->ntouched++] = b;
+            }
+    for (uint i = 1; i < sb->ninodes && ndirty > 0; i++)
+        if (dirty[i]) {
+            st->mark[i] = 1;
+            remove_dents(img, st, i);
+            if (iget(img, i)->type != 0)
+                check_blocks(img, st, i);
+        }
+    for (uint i = 1; i < sb->ninodes && ndirty > 0; i++)
+        if (dirty[i] && iget(img, i)->type == T_DIR)
+            add_dents(img, st, i);
+    for (uint i = 1; i < sb->ninodes && ndirty > 0; i++)
+        if (st->mark[i])
+            check_inode(img, st, i);
+
+    // bits changed since the last check as well as those of the blocks
+    // claimed again
+    uint n = bitmap_bytes(sb->size);
+    uchar *bitmap = malloc(n);
+    copy_bitmap(img, bitmap);
+    for (uint k = 0; k < n; k++)
+        if (bitmap[k] != st->bitmap[k]) {
+            st->changed = true;
+            for (uint b = k * 8; b < k * 8 + 8 && b < sb->size; b++)
+                if (bitmap_bit(bitmap, b) != bitmap_bit(st->bitmap, b))
+                    check_bit(img, st, b);
+        }
+    for (uint k = 0; k < st->ntouched; k++)
+        check_bit(img, st, st->touched[k]);
+    free(st->bitmap);
+    st->bitmap = bitmap;
+    free(dirty);
+    st->changed |= ndirty > 0;
+    return ndirty;
+}
+
+static int fsck_save(struct fsck_state *st, char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    uint64 magic = FSCK_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, fp);
+    uint geom[4] = { st->size, st->ninodes, st->bsize, st->features };
+    fwrite(geom, sizeof(geom), 1, fp);
+    fwrite(st->ihash, sizeof(uint64), st->ninodes, fp);
+    fwrite(st->refs, sizeof(uint), st->ninodes, fp);
+    fwrite(st->parent, sizeof(uint), st->ninodes, fp);
+    fwrite(st->dotdot, sizeof(uint), st->ninodes, fp);
+    fwrite(st->ndents, sizeof(uint), st->ninodes, fp);
+    for (uint i = 0; i < st->ninodes; i++)
+        fwrite(st->dents[i], sizeof(uint), st->ndents[i], fp);
+    fwrite(st->bitmap, 1, bitmap_bytes(st->size), fp);
+    // owners as runs of (first block, # of blocks, owner)
+    for (uint b = 0; b < st->size; ) {
+        uint e = b + 1;
+        while (e < st->size && st->owner[e] == st->owner[b])
+            e++;
+        uint run[3] = { b, e - b, st->owner[b] };
+        if (st->owner[b] != 0)
+            fwrite(run, sizeof(run), 1, fp);
+        b = e;
+    }
+    uint end[3] = { 0, 0, 0 };
+    fwrite(end, sizeof(end), 1, fp);
+    for (uint b = 0; b < st->size; b++)
+        if (st->bhash[b] != 0) {
+            fwrite(&b, sizeof(b), 1, fp);
+            fwrite(&st->bhash[b], sizeof(uint64), 1, fp);
+        }
+    if (fclose(fp) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// loads the state of the last check; returns -1 if it is missing or does
+// not match the image
+static int fsck_load(img_t img, struct fsck_state *st, char *path) {
+    struct superblock *sb = SBLK(img);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    uint64 magic;
+    uint geom[4];
+    if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != FSCK_MAGIC ||
+        fread(geom, sizeof(geom), 1, fp) != 1 || geom[0] != sb->size ||
+        geom[1] != sb->ninodes || geom[2] != img->bsize ||
+        geom[3] != img->features ||
+        fsck_alloc(st, sb->size, sb->ninodes) < 0)
+        goto fail;
+    uint n = st->ninodes;
+    if (fread(st->ihash, sizeof(uint64), n, fp) != n ||
+        fread(st->refs, sizeof(uint), n, fp) != n ||
+        fread(st->parent, sizeof(uint), n, fp) != n ||
+        fread(st->dotdot, sizeof(uint), n, fp) != n ||
+        fread(st->ndents, sizeof(uint), n, fp) != n)
+        goto fail;
+    for (uint i = 0; i < n; i++) {
+        if (st->ndents[i] == 0)
+            continue;
+        if (st->ndents[i] > (uint64)sb->size * img->bsize ||
+            (st->dents[i] = malloc(st->ndents[i] * sizeof(uint))) == NULL ||
+            fread(st->dents[i], sizeof(uint), st->ndents[i], fp) !=
+            st->ndents[i])
+            goto fail;
+    }
+    if (fread(st->bitmap, 1, bitmap_bytes(st->size), fp) !=
+        bitmap_bytes(st->size))
+        goto fail;
+    uint run[3];
+    while (fread(run, sizeof(run), 1, fp) == 1 && run[1] != 0) {
+        if (run[0] + (uint64)run[1] > st->size)
+            goto fail;
+        for (uint b = run[0]; b < run[0] + run[1]; b++)
+            st->owner[b] = run[2];
+    }
+    uint b;
+    uint64 h;
+    while (fread(&b, sizeof(b), 1, fp) == 1 &&
+           fread(&h, sizeof(h), 1, fp) == 1) {
+        if (b >= st->size || st->nmeta == st->size)
+            goto fail;
+        st->bhash[b] = h;
+        st->meta[st->nmeta++] = b;
+    }
+    fclose(fp);
+    return 0;
+fail:
+    fclose(fp);
+    return -1;
+}
+
+// fsck [--incremental] [state_file]
+int do_fsck(img_t img, int argc, char *argv[]) {
+    bool incremental = argc > 0 && strcmp(argv[0], "--incremental") == 0;
+    if (incremental) {
+        argc--;
+        argv++;
+    }
+    if (argc > 1) {
+        error("usage: %s img_file fsck [--incremental] [state_file]\n",
+              progname);
+        return EXIT_FAILURE;
+    }
+    // the state is saved only if it is asked for
+    bool save = incremental || argc == 1;
+    char path[BUFSIZE];
+    if (argc == 1)
+        snprintf(path, sizeof(path), "%s", argv[0]);
+    else
+        snprintf(path, sizeof(path), "%s.fsck", img_path);
+
+    struct superblock *sb = SBLK(img);
+    struct fsck_state st = { 0 };
+    uint nchecked = sb->ninodes - 1;
+    if (incremental && fsck_load(img, &st, path) == 0)
+        nchecked = fsck_incremental(img, &st);
+    else {
+        if (incremental)
+            printf("fsck: %s: no usable state, checking everything\n", path);
+        fsck_free(&st);
+        memset(&st, 0, sizeof(st));
+        if (fsck_alloc(&st, sb->size, sb->ninodes) < 0) {
+            fsck_free(&st);
+            return EXIT_FAILURE;
+        }
+        fsck_full(img, &st);
+        st.changed = true;
+    }
+    st.bsize = img->bsize;
+    st.features = img->features;
+    int status = EXIT_FAILURE;
+    if (st.nerrors > 0)
+        printf("fsck: %u errors\n", st.nerrors);
+    else {
+        // a state that cannot be saved does not fail the check
+        if (save && st.changed && fsck_save(&st, path) < 0)
+            error("fsck: %s: state not saved\n", path);
+        printf("fsck: ok (%u inodes checked)\n", nchecked);
+        status = EXIT_SUCCESS;
+    }
+    fsck_free(&st);
+    return status;
+}
 
 struct cmd_table_ent {
     char *name;
     char *args;
     int (*fun)(img_t, int, char **);
+    bool untraced;  // changes images in ways the trace does not record
 };
 
 struct cmd_table_ent cmd_table[] = {
-    { "diskinfo", "", do_diskinfo },
-    { "info", "path", do_info },
-    { "ls", "path", do_ls },
-    { "get", "path", do_get },
-    { "put", "path", do_put },
-    { "rm", "path", do_rm },
-    { "cp", "spath dpath", do_cp },
-    { "mv", "spath dpath", do_mv },
-    { "ln", "spath dpath", do_ln },
-    { "mkdir", "path", do_mkdir },
-    { "rmdir", "path", do_rmdir },
+    { "diskinfo", "", do_diskinfo, false },
+    { "info", "path", do_info, false },
+    { "ls", "[-lRSni] [-c cursor] [-m max] [path]", do_ls, false },
+    { "get", "path", do_get, false },
+    { "put", "path", do_put, false },
+    { "rm", "path", do_rm, false },
+    { "cp", "spath dpath", do_cp, false },
+    { "mv", "spath dpath", do_mv, false },
+    { "ln", "spath dpath", do_ln, false },
+    { "mkdir", "path", do_mkdir, false },
+    { "rmdir", "path", do_rmdir, false },
+    { "fallocate", "path size", do_fallocate, true },
+    { "index-dirs", "[path]", do_index_dirs, true },
+    { "compact-dirs", "[-s] [path]", do_compact_dirs, true },
+    { "compact-inodes", "", do_compact_inodes, true },
+    { "convert", "format out_img_file", do_convert, true },
+    { "repack", "[-s] [--fit] out_img_file", do_repack, true },
+    { "fsck", "[--incremental] [state_file]", do_fsck, false },
 };
 
 int exec_cmd(img_t img, char *cmd, int argc, char *argv[]) {
     for (uint i = 0; i < ALEN(cmd_table); i++) {
-        if (strcmp(cmd, cmd_table[i].name) == 0)
-            return cmd_table[i].fun(img, argc, argv);
+        if (strcmp(cmd, cmd_table[i].name) != 0)
+            continue;
+        // replay could not reproduce the image after such a command
+        if (cmd_table[i].untraced && trace_file != NULL) {
+            error("%s: cannot be traced\n", cmd);
+            return EXIT_FAILURE;
+        }
+        return cmd_table[i].fun(img, argc, argv);
     }
     error("unknown command: %s\n", cmd);
     return EXIT_FAILURE;
 }
 
-int main(int argc, char *argv[]) {
-    progname = argv[0];
+// prints the performance counters and the resource usage to stderr
+static void print_stats(struct timespec *t0, struct timespec *t1) {
+    for (uint i = 0; i < NPERFCOUNTERS; i++)
+        error("%-24s %lu\n", perf_names[i], perf_counters[i]);
+    double ms = (t1->tv_sec - t0->tv_sec) * 1e3 +
+        (t1->tv_nsec - t0->tv_nsec) / 1e6;
+    error("%-24s %.3f\n", "wall time (ms)", ms);
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        error("%-24s %ld\n", "minor page faults", ru.ru_minflt);
+        error("%-24s %ld\n", "major page faults", ru.ru_majflt);
+        error("%-24s %ld\n", "max RSS (KiB)", ru.ru_maxrss);
+    }
+}
+
+static int opfs(int argc, char *argv[]) {
     if (argc < 3) {
-        error("usage: %s img_file command [arg...]\n", progname);
+        error("usage: %s [--trace trace_file] [--block-trace blktrace_file] "
+              "[--stats] [--latency] [--readahead nblocks] "
+              "[--balloc policy] img_file command [arg...]\n", progname);
         error("Commands are:\n");
         for (uint i = 0; i < ALEN(cmd_table); i++)
             error("    %s %s\n", cmd_table[i].name, cmd_table[i].args);
@@ -590,6 +1950,7 @@ int main(int argc, char *argv[]) {
     }
     char *img_file = argv[1];
     char *cmd = argv[2];
+    img_path = img_file;
 
     int img_fd = open(img_file, O_RDWR);
     if (img_fd < 0) {
@@ -605,9 +1966,9 @@ int main(int argc, char *argv[]) {
     }
     size_t img_size = (size_t)img_sbuf.st_size;
 
-    img_t img = mmap(NULL, img_size, PROT_READ | PROT_WRITE,
-                     MAP_SHARED, img_fd, 0);
-    if (img == MAP_FAILED) {
+    uchar *img_base = mmap(NULL, img_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, img_fd, 0);
+    if (img_base == MAP_FAILED) {
         perror(img_file);
         close(img_fd);
         return EXIT_FAILURE;
@@ -615,8 +1976,11 @@ int main(int argc, char *argv[]) {
 
     int status = EXIT_FAILURE;
 
-    uint magic = SBLK(img)->magic;
-    if (magic != FSMAGIC) {
+    struct img img_buf;
+    img_t img = &img_buf;
+    if (loadimg(img, img_base, img_size) < 0) {
+        uint magic = img_size >= 2 * BSIZE ?
+            ((struct superblock *)(img_base + BSIZE))->magic : 0;
         error("%s: invalid magic number: 0x%x\n", img_file, magic);
         goto bye;
     }
@@ -628,12 +1992,82 @@ int main(int argc, char *argv[]) {
         status = exec_cmd(img, cmd, argc - 3, argv + 3);
 
 bye:
-    munmap(img, img_size);
+    munmap(img_base, img_size);
     close(img_fd);
 
     return status;
 }
 
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    char *trace_path = NULL, *blktrace_path = NULL;
+    bool stats = false;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--trace") == 0 && argc > 2) {
+            trace_path = argv[2];
+            if (trace_open(trace_path) < 0)
+                return EXIT_FAILURE;
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--block-trace") == 0 && argc > 2) {
+            blktrace_path = argv[2];
+            if (blktrace_open(blktrace_path) < 0)
+                return EXIT_FAILURE;
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--stats") == 0)
+            perf_enabled = stats = true;
+        else if (strcmp(argv[1], "--latency") == 0)
+            lat_enabled = true;
+        else if (strcmp(argv[1], "--readahead") == 0 && argc > 2) {
+            char *end;
+            unsigned long n = strtoul(argv[2], &end, 10);
+            if (*argv[2] == 0 || *end != 0 || n > 0xffffffffUL) {
+                error("%s: %s: invalid number of blocks\n", progname,
+                      argv[2]);
+                return EXIT_FAILURE;
+            }
+            readahead_setwindow(n);
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--balloc") == 0 && argc > 2) {
+            if (balloc_setpolicy(argv[2]) < 0) {
+                error("%s: %s: unknown allocation policy\n", progname,
+                      argv[2]);
+                return EXIT_FAILURE;
+            }
+            argc--;
+            argv++;
+        }
+        else
+            break;
+        argc--;
+        argv++;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int status = opfs(argc, argv);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (trace_close() != 0) {
+        perror(trace_path);
+        status = EXIT_FAILURE;
+    }
+    if (blktrace_close() != 0) {
+        perror(blktrace_path);
+        status = EXIT_FAILURE;
+    }
+    if (stats)
+        print_stats(&t0, &t1);
+    if (lat_enabled)
+        lat_report(stderr);
+    return status;
+}
+
 /* For Emacs
  * Local Variables: ***
  * c-file-style: "gnu" ***
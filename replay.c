@@ -0,0 +1,285 @@
+/*
+ * opfs: a simple utility for replaying operation traces of opfs
+ * Copyright (c) 2015-2020 Takuo Watanabe
+ */
+
+/* usage: replay [-r reps] [-v] [-l] img_file trace_file
+ *     reps : # of times the trace is replayed (default: 1)
+ *     -v : reports each operation whose result differs from the trace
+ *     -l : prints the latency histograms of the libfs operations; they
+ *          are also printed whenever SIGUSR1 is received
+ *     trace_file : trace recorded by opfs --trace
+ *
+ * Each replay starts from a fresh private copy of the image, which is
+ * never modified.  Written data are replaced by zeros.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+
+#include "libfs.h"
+
+static char *opnames[NTRACEOPS] = {
+    [TR_LOOKUP] = "lookup",
+    [TR_DLOOKUP] = "dlookup",
+    [TR_CREATE] = "create",
+    [TR_LINK] = "link",
+    [TR_UNLINK] = "unlink",
+    [TR_READ] = "read",
+    [TR_WRITE] = "write",
+    [TR_TRUNCATE] = "truncate",
+    [TR_SESSION] = "session",
+};
+
+// statistics of each kind of operations
+struct opstat {
+    uint64 count;
+    uint64 bytes;       // bytes read or written
+    double ns;
+};
+
+static bool verbose = false;
+
+// set by SIGUSR1 to print the latency histograms so far
+static volatile sig_atomic_t lat_requested = 0;
+
+static void request_lat(int sig) {
+    UNUSED(sig);
+    lat_requested = 1;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// reads the whole trace file; returns its size or -1
+static long load_trace(char *path, uchar **bufp) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uchar *buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size) {
+        error("%s: cannot read the trace\n", path);
+        fclose(fp);
+        free(buf);
+        return -1;
+    }
+    fclose(fp);
+    uint magic;
+    if ((size_t)size < sizeof(magic) ||
+        (memcpy(&magic, buf, sizeof(magic)), magic != TRACE_MAGIC)) {
+        error("%s: not a trace file\n", path);
+        free(buf);
+        return -1;
+    }
+    *bufp = buf;
+    return size;
+}
+
+// executes a trace record; returns its result
+static int execute(img_t img, struct trace_rec *rec, char *path, uchar *buf) {
+    if (rec->inum == 0 || rec->inum >= SBLK(img)->ninodes)
+        return -1;
+    inode_t ip = iget(img, rec->inum);
+    bool dir = ip->type == T_DIR;
+    inode_t r;
+    switch (rec->op) {
+    case TR_LOOKUP:
+        return dir && (r = ilookup(img, ip, path)) != NULL ? geti(img, r) : 0;
+    case TR_DLOOKUP:
+        return dir && (r = dlookup(img, ip, path, NULL)) != NULL ?
+            geti(img, r) : 0;
+    case TR_CREATE:
+        return dir && (r = icreat(img, ip, path, rec->n, NULL)) != NULL ?
+            geti(img, r) : 0;
+    case TR_LINK:
+        if (!dir || rec->n == 0 || rec->n >= SBLK(img)->ninodes)
+            return -1;
+        return daddent(img, ip, path, iget(img, rec->n));
+    case TR_UNLINK:
+        return dir ? iunlink(img, ip, path) : -1;
+    case TR_READ:
+        return iread(img, ip, buf, rec->n, rec->off);
+    case TR_WRITE:
+        return iwrite(img, ip, buf, rec->n, rec->off);
+    case TR_TRUNCATE:
+        return itruncate(img, ip, rec->n);
+    }
+    return -1;
+}
+
+// replays a trace on an image; returns the # of mismatched results or -1
+static long replay(img_t img, uchar *trace, long size, uchar *buf,
+                   struct opstat *stats) {
+    long mismatches = 0;
+    char path[0x10000];
+    for (long p = sizeof(uint); p < size; ) {
+        struct trace_rec rec;
+        if ((size_t)(size - p) < sizeof(rec)) {
+            error("truncated trace\n");
+            return -1;
+        }
+        memcpy(&rec, trace + p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.op == 0 || rec.op >= NTRACEOPS || size - p < rec.pathlen) {
+            error("broken trace record at %ld\n", p - (long)sizeof(rec));
+            return -1;
+        }
+        memcpy(path, trace + p, rec.pathlen);
+        path[rec.pathlen] = 0;
+        p += rec.pathlen;
+        // the next commands ran in a new process
+        if (rec.op == TR_SESSION) {
+            resethints(img);
+            continue;
+        }
+
+        double t0 = now_ns();
+        int res = execute(img, &rec, path, buf);
+        stats[rec.op].ns += now_ns() - t0;
+        stats[rec.op].count++;
+        if (rec.op == TR_READ || rec.op == TR_WRITE)
+            stats[rec.op].bytes += res > 0 ? res : 0;
+        if (lat_requested) {
+            lat_requested = 0;
+            lat_report(stderr);
+        }
+        if (res != rec.res) {
+            mismatches++;
+            if (verbose)
+                error("%s %u %s: %d (expected %d)\n", opnames[rec.op],
+                      rec.inum, path, res, rec.res);
+        }
+    }
+    return mismatches;
+}
+
+// replay aborted by fatal errors of libfs
+static long try_replay(img_t img, uchar *trace, long size, uchar *buf,
+                       struct opstat *stats) {
+    if (setjmp(fatal_exception_buf) != 0)
+        return -1;
+    return replay(img, trace, size, buf, stats);
+}
+
+int main(int argc, char *argv[]) {
+    progname = argv[0];
+    uint reps = 1;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[i], "-l") == 0) {
+            lat_enabled = true;
+            signal(SIGUSR1, request_lat);
+        }
+        else
+            break;
+    }
+    if (argc - i != 2 || reps < 1) {
+        error("usage: %s [-r reps] [-v] [-l] img_file trace_file\n",
+              progname);
+        return EXIT_FAILURE;
+    }
+    char *img_file = argv[i];
+    uchar *trace;
+    long trace_size = load_trace(argv[i + 1], &trace);
+    if (trace_size < 0)
+        return EXIT_FAILURE;
+
+    // a buffer large enough for every read and write
+    uint maxn = 1;
+    struct trace_rec rec;
+    for (long p = sizeof(uint); p + (long)sizeof(rec) <= trace_size; ) {
+        memcpy(&rec, trace + p, sizeof(rec));
+        if ((rec.op == TR_READ || rec.op == TR_WRITE) && rec.n > maxn)
+            maxn = rec.n;
+        p += sizeof(rec) + rec.pathlen;
+    }
+    uchar *buf = calloc(1, maxn);
+
+    int img_fd = open(img_file, O_RDONLY);
+    struct stat img_sbuf;
+    if (img_fd < 0 || fstat(img_fd, &img_sbuf) < 0) {
+        perror(img_file);
+        return EXIT_FAILURE;
+    }
+    size_t img_size = (size_t)img_sbuf.st_size;
+
+    struct opstat stats[NTRACEOPS] = { { 0 } };
+    double total = 0;
+    int status = EXIT_SUCCESS;
+    for (uint r = 0; r < reps; r++) {
+        // a private mapping is a fresh copy of the image on each replay
+        uchar *img_base = mmap(NULL, img_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE, img_fd, 0);
+        if (img_base == MAP_FAILED) {
+            perror(img_file);
+            return EXIT_FAILURE;
+        }
+        struct img img_buf;
+        img_t img = &img_buf;
+        if (loadimg(img, img_base, img_size) < 0) {
+            error("%s: not an xv6 file system image\n", img_file);
+            return EXIT_FAILURE;
+        }
+        root_inode = iget(img, root_inode_number);
+        double t0 = now_ns();
+        long mismatches = try_replay(img, trace, trace_size, buf, stats);
+        total += now_ns() - t0;
+        munmap(img_base, img_size);
+        if (mismatches != 0) {
+            if (mismatches > 0)
+                error("replay %u: %ld results differ from the trace\n",
+                      r + 1, mismatches);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    printf("%-10s %12s %14s %12s %10s\n",
+           "operation", "count", "bytes", "total_ms", "mean_ns");
+    for (uint op = 1; op < NTRACEOPS; op++) {
+        struct opstat *s = &stats[op];
+        if (s->count == 0)
+            continue;
+        printf("%-10s %12lu %14lu %12.3f %10.1f\n", opnames[op],
+               s->count / reps, s->bytes / reps, s->ns / reps / 1e6,
+               s->ns / s->count);
+    }
+    printf("wall time (ms): %.3f\n", total / reps / 1e6);
+    if (lat_enabled)
+        lat_report(stdout);
+
+    free(buf);
+    free(trace);
+    close(img_fd);
+    return status;
+}
+
+/* For Emacs
+ * Local Variables: ***
+ * c-file-style: "gnu" ***
+ * c-basic-offset: 4 ***
+ * End: ***
+ */
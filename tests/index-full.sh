@@ -0,0 +1,41 @@
+#!/bin/sh
+# index-full: tests of indexing a directory on a full image
+# Copyright (c) 2015-2020 Takuo Watanabe
+#
+# usage: tests/index-full.sh [bindir]
+#     bindir : directory containing the commands (default: .)
+
+set -e
+BIN=${1:-.}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+IMG=$TMP/fs.img
+
+# a directory of 4 blocks, then a file taking every free block
+"$BIN/newfs" "$IMG" 200 300 10 >/dev/null
+"$BIN/opfs" "$IMG" mkdir /d
+for i in $(seq 1 200); do
+    "$BIN/opfs" "$IMG" put /d/f$i < /dev/null
+done
+"$BIN/opfs" "$IMG" ls /d | cut -d" " -f1-3 | sort > "$TMP/ls0"
+head -c 1000000 /dev/zero > "$TMP/data"
+if "$BIN/opfs" "$IMG" put /data < "$TMP/data" 2>/dev/null; then
+    echo "index-full: the image is not full" >&2
+    exit 1
+fi
+
+# the index cannot be built, and the entries (names, types and i-node
+# numbers) are left as they were
+if "$BIN/opfs" "$IMG" index-dirs 2>/dev/null; then
+    echo "index-full: index-dirs succeeded on a full image" >&2
+    exit 1
+fi
+"$BIN/opfs" "$IMG" ls /d | cut -d" " -f1-3 | sort | cmp - "$TMP/ls0"
+"$BIN/opfs" "$IMG" fsck >/dev/null
+
+# with free blocks again, the index is built with every entry
+"$BIN/opfs" "$IMG" rm /data
+"$BIN/opfs" "$IMG" index-dirs
+"$BIN/opfs" "$IMG" ls /d | cut -d" " -f1-3 | sort | cmp - "$TMP/ls0"
+"$BIN/opfs" "$IMG" fsck >/dev/null
+echo ok
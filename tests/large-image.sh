@@ -0,0 +1,25 @@
+#!/bin/sh
+# large-image: tests of an image larger than 4 GiB (a sparse file)
+# Copyright (c) 2015-2020 Takuo Watanabe
+#
+# usage: tests/large-image.sh [bindir]
+#     bindir : directory containing the commands (default: .)
+
+set -e
+BIN=${1:-.}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+IMG=$TMP/large.img
+
+# 1310720 blocks of 4 KiB: 5 GiB
+"$BIN/newfs" --bsize 4096 --dindirect "$IMG" 1310720 1000 30 >/dev/null
+"$BIN/opfs" "$IMG" diskinfo | grep -q "(5368709120 bytes)" || {
+    echo "large-image: wrong image size" >&2
+    "$BIN/opfs" "$IMG" diskinfo >&2
+    exit 1
+}
+head -c 3000000 /dev/urandom > "$TMP/data"
+"$BIN/opfs" "$IMG" put /data < "$TMP/data"
+"$BIN/opfs" "$IMG" get /data | cmp - "$TMP/data"
+"$BIN/opfs" "$IMG" fsck "$TMP/state" >/dev/null
+echo ok
@@ -0,0 +1,135 @@
+/*
+ * largefile: tests of files larger than 2 GiB on an image built in memory
+ * Copyright (c) 2015-2020 Takuo Watanabe
+ */
+
+/* usage: largefile
+ *
+ * A file next to another one is grown past 2 GiB by itruncate; the data
+ * of the other file, the contents of the grown file and the number of
+ * blocks allocated to it are checked.  Prints "ok" and
+ * exits with 0 if all the checks pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include "libfs.h"
+
+#define TBSIZE 4096
+#define BIGSIZE 2200000000U     // beyond 2 GiB and below maxfilesize
+
+static int nfail = 0;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { error(__VA_ARGS__); nfail++; } } while (0)
+
+static struct img img_buf;
+
+// makes an empty file system of size blocks in memory
+static img_t mkimg(uint size) {
+    size_t nbytes = (size_t)size * TBSIZE;
+    uchar *base = calloc(1, nbytes);
+    if (base == NULL) {
+        error("cannot allocate %zu bytes\n", nbytes);
+        exit(EXIT_FAILURE);
+    }
+    img_t img = &img_buf;
+    if (initimg(img, &fsformats[0], base, nbytes, TBSIZE, FS_DINDIRECT) < 0 ||
+        mkfs(img, size, 200, 30) < 0) {
+        error("cannot make a file system\n");
+        exit(EXIT_FAILURE);
+    }
+    root_inode = iget(img, root_inode_number);
+    return img;
+}
+
+static int count_block(img_t img, uint b, void *arg) {
+    UNUSED(img);
+    UNUSED(b);
+    (*(uint *)arg)++;
+    return 0;
+}
+
+// # of data and indirect blocks a file of size bytes needs
+static uint blocks_for(img_t img, uint64 size) {
+    uint64 n = (size + img->bsize - 1) / img->bsize;
+    uint64 m = n;
+    if (n > img->ndirect)
+        m++;
+    if (n > img->ndirect + img->nindirect)
+        m += 1 + (n - img->ndirect - img->nindirect + img->nindirect - 1) /
+            img->nindirect;
+    return m;
+}
+
+// checks that f has the blocks for its size and zeros from off, and that
+// g still holds its data
+static void check(img_t img, char *what, inode_t f, uint off, inode_t g,
+                  uchar *gdata, uint glen) {
+    static uchar buf[8192];
+    CHECK(f->size == BIGSIZE, "%s: size %u (expected %u)\n", what, f->size,
+          BIGSIZE);
+    uint n = 0;
+    iblocks(img, f, count_block, &n);
+    CHECK(n == blocks_for(img, f->size), "%s: %u blocks (expected %u)\n",
+          what, n, blocks_for(img, f->size));
+    uint offs[] = { off, off + TBSIZE - 1, BIGSIZE / 2, BIGSIZE - 8192 };
+    for (uint i = 0; i < ALEN(offs); i++) {
+        memset(buf, 0xff, sizeof(buf));
+        CHECK(iread(img, f, buf, sizeof(buf), offs[i]) == sizeof(buf),
+              "%s: cannot read at %u\n", what, offs[i]);
+        for (uint j = 0; j < sizeof(buf); j++)
+            if (buf[j] != 0) {
+                CHECK(false, "%s: nonzero byte at %u\n", what, offs[i] + j);
+                break;
+            }
+    }
+    CHECK(iread(img, g, buf, glen, 0) == (int)glen &&
+          memcmp(buf, gdata, glen) == 0, "%s: data of g changed\n", what);
+}
+
+int main(int argc, char *argv[]) {
+    UNUSED(argc);
+    progname = argv[0];
+    if (setjmp(fatal_exception_buf) != 0)
+        return EXIT_FAILURE;
+
+    img_t img = mkimg(BIGSIZE / TBSIZE + 2000);
+    static uchar gdata[8192];
+    for (uint i = 0; i < sizeof(gdata); i++)
+        gdata[i] = i * 7 + 1;
+
+    // itruncate
+    inode_t f = icreat(img, root_inode, "f", T_FILE, NULL);
+    inode_t g = icreat(img, root_inode, "g", T_FILE, NULL);
+    CHECK(iwrite(img, f, (uchar *)"x", 1, 0) == 1, "cannot write f\n");
+    CHECK(iwrite(img, g, gdata, sizeof(gdata), 0) == sizeof(gdata),
+          "cannot write g\n");
+    CHECK(itruncate(img, f, BIGSIZE) == 0, "itruncate failed\n");
+    check(img, "itruncate", f, 1, g, gdata, sizeof(gdata));
+
+    // shrinking frees the blocks again
+    CHECK(itruncate(img, f, 0) == 0, "itruncate to 0 failed\n");
+    uint n = 0;
+    iblocks(img, f, count_block, &n);
+    CHECK(n == 0, "%u blocks left after itruncate to 0\n", n);
+
+    if (nfail > 0) {
+        error("%d check(s) failed\n", nfail);
+        return EXIT_FAILURE;
+    }
+    printf("ok\n");
+    return EXIT_SUCCESS;
+}
+
+/* For Emacs
+ * Local Variables: ***
+ * c-file-style: "gnu" ***
+ * c-basic-offset: 4 ***
+ * End: ***
+ */
@@ -0,0 +1,33 @@
+#!/bin/sh
+# replay: tests of replaying a trace recorded by several opfs commands
+# Copyright (c) 2015-2020 Takuo Watanabe
+#
+# usage: tests/replay.sh [bindir]
+#     bindir : directory containing the commands (default: .)
+
+set -e
+BIN=${1:-.}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+IMG=$TMP/fs.img
+TRC=$TMP/fs.trc
+
+"$BIN/newfs" "$IMG" 2000 200 30 >/dev/null
+cp "$IMG" "$TMP/fs0.img"
+head -c 50000 /dev/urandom > "$TMP/data"
+# each command runs in its own process, starting with fresh allocation
+# hints, so the inodes and blocks freed by one are reused by the next
+"$BIN/opfs" --trace "$TRC" "$IMG" mkdir /d
+"$BIN/opfs" --trace "$TRC" "$IMG" rmdir /d
+"$BIN/opfs" --trace "$TRC" "$IMG" mkdir /e
+"$BIN/opfs" --trace "$TRC" "$IMG" put /e/f < "$TMP/data"
+"$BIN/opfs" --trace "$TRC" "$IMG" rm /e/f
+"$BIN/opfs" --trace "$TRC" "$IMG" put /g < "$TMP/data"
+"$BIN/opfs" --trace "$TRC" "$IMG" get /g > /dev/null
+# commands whose changes are not recorded are rejected
+if "$BIN/opfs" --trace "$TRC" "$IMG" compact-dirs 2>/dev/null; then
+    echo "replay: compact-dirs was traced" >&2
+    exit 1
+fi
+"$BIN/replay" -v -r 2 "$TMP/fs0.img" "$TRC" >/dev/null
+echo ok